@@ -14,6 +14,7 @@
 #include "I2CLib.h"
 #include "BNO085.h"
 #include "stdio.h"      // For NULL
+#include <stdlib.h>     // For labs
 
 #define BNO_ADDRESS 0x4A
 
@@ -22,35 +23,92 @@
 volatile uint8_t buffer[BUFFER_SIZE];
 volatile unsigned int numBytes = 0;
 volatile unsigned int lastTransferSize = 0;
-volatile GravityVector gravityVector;
-volatile GravityVector accVector;
+#define MAX_CHANNELS 6
+#define SHTP_HEADER_SIZE 4
+volatile unsigned int channelPacketSize[MAX_CHANNELS]; // length of the last packet seen on each channel, 0 if none yet
+volatile unsigned int readAheadSize = SHTP_HEADER_SIZE; // bytes the next read will ask for
+volatile unsigned int requestedBytes = SHTP_HEADER_SIZE; // bytes the read in progress asked for
+
+// Running totals for one sensor. These are only written by processMessage() and
+// never reset, readers work out the average since their last read from the difference.
+typedef struct {
+    unsigned long sumX, sumY, sumZ; // sum of all raw samples (wraps around)
+    unsigned long deltaTime;        // sum of all timestamp deltas
+    unsigned int count;             // number of samples (wraps around)
+} SensorTotals;
+
+// What a reader saw the last time it read a sensor
+typedef struct {
+    SensorTotals totals;
+    float x, y, z;                  // last average, kept while no new samples arrive
+} SensorReading;
+
+// Sequence lock for all of the sensor totals. It is odd while the totals are being
+// written, and readers retry if it changed while they were copying.
+volatile unsigned int sensorSequence = 0;
+volatile SensorTotals gravityTotals;
+volatile SensorTotals accTotals;
+SensorReading gravityReading;
+SensorReading accReading;
 volatile uint8_t bnoControlChannel = 0xFF;     // Will be set to channel ID of "control"
 volatile uint8_t bnoInputChannel = 0xFF;       // Will be set to channel ID of "inputNormal"
 volatile uint8_t bnoDeviceChannel = 0xFF;      // Will be set to channel ID of "device"
 volatile uint8_t send_sequence = 0;
 volatile uint8_t waiting = 0;
-volatile unsigned int overflow = 0;
+volatile uint8_t parsePending = 0;    // a whole message is waiting for room in the deferred work queue
 volatile int resetStatus = 0;
+volatile uint8_t motionActive = 1;     // which accelerometer report profile is active
+volatile uint8_t quietSamples = 0;     // still samples in a row seen by the motion detector
+volatile uint8_t hasAccBaseline = 0;
+volatile int16_t lastAccRaw[3];        // last raw accelerometer sample (Q8)
 #define Q14_SCALE (1.0f / 16384.0f) // Q14 means the number should be divided by 2^14
 #define Q12_SCALE (1.0f / 4096.0f)
 #define Q8_SCALE (1.0f / 256.0f)
 #define MIN_ACCURACY 2
+#define READ_TIMEOUT_TICKS 50000 // Timer1 ticks before a read is retried (25 ms at 1:8)
 #define GRAVITY_REPORT_INTERVAL 0x2710 // 0xC350 // in microseconds (50000 us = 20Hz)
+#define MOTION_REPORT_INTERVAL GRAVITY_REPORT_INTERVAL // accelerometer interval while moving
+#define IDLE_REPORT_INTERVAL 0x186A0 // accelerometer interval while still (100000 us = 10Hz)
+#define MOTION_ENTER_THRESHOLD 128 // Q8 sum of |change| on all axes (0.5 m/s^2) to switch to motion
+#define MOTION_EXIT_THRESHOLD 32   // Q8 sum of |change| on all axes (0.125 m/s^2) that counts as still
+#define IDLE_SAMPLE_COUNT 50       // still samples in a row before switching to idle (~0.5 s)
 #define GRAVITY_VECTOR_ID 0x06
 #define ROTATION_VECTOR_ID 0x05
 #define LINEAR_ACC_ID 0x04
 #define ACCEL_ID 0x01
 
-unsigned int receive_byte(uint8_t, int);
+int receive_byte(uint8_t, int);
+void processMessage();
 int strncmp(const char* str1, const char* str2);
 
+/* Start the one-shot read watchdog. If the read hasn't finished by the time
+ * Timer1 reaches PR1, _T1Interrupt gives up on it and tries again.
+ */
+void arm_read_watchdog() {
+    TMR1 = 0;
+    IFS0bits.T1IF = 0;
+    T1CONbits.TON = 1;
+}
+
+/* Stop the read watchdog once the outstanding read is complete.
+ */
+void disarm_read_watchdog() {
+    T1CONbits.TON = 0;
+    IFS0bits.T1IF = 0;
+}
+
 void request_data() {
-    // request data if there is space in the transmission and we aren't already waiting for data.
-    // or request if timed out, 1 overflow = ~ 4 ms
-    if ((waiting == 0 || overflow > 5) && getTransmissionsUsed() < 16) {
-        transmit_packet((BNO_ADDRESS << 1) | 0x01, 0, 4); // read SHTP Header
-        waiting = 1;
-        overflow = 0;
+    // request data if we aren't already waiting for data
+    if (waiting == 0) {
+        if (getTransmissionsUsed() < 16) {
+            // read the SHTP header and the expected payload in one transfer,
+            // receive_byte() trims or extends it once the header arrives
+            requestedBytes = readAheadSize;
+            transmit_packet((BNO_ADDRESS << 1) | 0x01, 0, requestedBytes);
+            waiting = 1;
+        }
+        // if there was no space the watchdog will retry later
+        arm_read_watchdog();
     }
 }
 // initialize I2C on PIC and run initialization sequence on the LCD
@@ -64,12 +122,11 @@ void bno085_init() {
     _INT0IE = 1;  // enable interrupt for INT0 events.
     _INT0IP = 3;  // lower priority
     
+    // Timer1 is a one-shot read watchdog, it only runs while a read is outstanding
     T1CON = 0;    
-    PR1 = 65535;  
+    PR1 = READ_TIMEOUT_TICKS;  
     TMR1 = 0;
-    T1CONbits.TCKPS = 0b00;
-
-    T1CONbits.TON = 1;
+    T1CONbits.TCKPS = 0b01; // 1:8 prescaler
 
     IFS0bits.T1IF = 0;
     IPC0bits.T1IP = 2;
@@ -77,17 +134,30 @@ void bno085_init() {
     
     
     if (PORTBbits.RB7 == 0 && _INT0IF == 0) {
-        request_data();
+        // data was already ready before INT0 was enabled
+        _INT0IF = 1;
     }
 }
 
 void __attribute__((__interrupt__,__auto_psv__)) _T1Interrupt(void)
 {
-    IFS0bits.T1IF = 0;
-    overflow++;
-    if (PORTBbits.RB7 == 0 && _INT0IF == 0) {
-         // could not request data on interrupt, try again
-        request_data();
+    disarm_read_watchdog();
+    if (parsePending) {
+        // the deferred work queue was full when the message arrived. waiting is
+        // still set, so no other read can call defer_work() while this does
+        if (defer_work((unsigned long) processMessage)) {
+            parsePending = 0;
+        } else {
+            arm_read_watchdog();
+        }
+        return;
+    }
+    
+    // read timed out
+    waiting = 0;
+    if (PORTBbits.RB7 == 0) {
+        // data is still ready, let INT0 issue the read again
+        _INT0IF = 1;
     }
 }
 
@@ -102,21 +172,28 @@ void __attribute__((__interrupt__,__auto_psv__)) _INT0Interrupt(void)
         _INT0IF = 0;
 }
 
-void enable_gravity_vector(){
-    // https://www.ceva-ip.com/wp-content/uploads/SH-2-Reference-Manual.pdf
-    // 6.5.4 Set Feature Command (Page 65)
+/* Send a Set Feature command to the sensor hub.
+ * https://www.ceva-ip.com/wp-content/uploads/SH-2-Reference-Manual.pdf
+ * 6.5.4 Set Feature Command (Page 65)
+ * 
+ * @param reportID      The feature report ID to configure.
+ * @param flags         The feature flags.
+ * @param sensitivity   The change sensitivity (same units as the report).
+ * @param interval      The report interval in microseconds.
+ */
+void set_feature(uint8_t reportID, uint8_t flags, uint16_t sensitivity, unsigned long interval) {
     uint8_t data[] = {
                     0x15, 0x00,        // SHTP header (length = 21 bytes) LSB then MSB
                     bnoControlChannel,              // Channel (Sensor Hub Control)
                     send_sequence++,              // Sequence number
                     0xFD,              // Set Feature Command
-                    GRAVITY_VECTOR_ID,              // Gravity Vector Feature Report ID
-                    0x00,        // Feature flags (0 = default)
-                    0x00, 0x00,        // Change sensitivity (disabled)
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL & 0xFF)), // 32-bit Report interval in microseconds LSB to MSB
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 8 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 16 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 24 & 0xFF)),  
+                    reportID,              // Feature Report ID
+                    flags,        // Feature flags
+                    ((uint8_t) (sensitivity & 0xFF)), ((uint8_t) (sensitivity >> 8 & 0xFF)),        // Change sensitivity LSB then MSB
+                    ((uint8_t) (interval & 0xFF)), // 32-bit Report interval in microseconds LSB to MSB
+                    ((uint8_t) (interval >> 8 & 0xFF)),
+                    ((uint8_t) (interval >> 16 & 0xFF)),
+                    ((uint8_t) (interval >> 24 & 0xFF)),  
                     0x00, 0x00, 0x00, 0x00,  // Batch interval (disabled)
                     0x00, 0x00, 0x00, 0x00   // Sensor-specific config (default)
                   };
@@ -124,67 +201,71 @@ void enable_gravity_vector(){
     transmit_packet(BNO_ADDRESS << 1, data, 21);
 }
 
+void enable_gravity_vector(){
+    set_feature(GRAVITY_VECTOR_ID, 0x00, 0x0000, GRAVITY_REPORT_INTERVAL);
+}
+
+/* Enable the accelerometer with the report profile for the current motion state.
+ * The idle profile only uses a longer interval. Reports keep coming while the
+ * board is still, because physics, rendering and the idle timer all run on
+ * the time in them.
+ */
 void enable_accelerometer(){
-    // https://www.ceva-ip.com/wp-content/uploads/SH-2-Reference-Manual.pdf
-    // 6.5.4 Set Feature Command (Page 65)
-    uint8_t data[] = {
-                    0x15, 0x00,        // SHTP header (length = 21 bytes) LSB then MSB
-                    bnoControlChannel,              // Channel (Sensor Hub Control)
-                    send_sequence++,              // Sequence number
-                    0xFD,              // Set Feature Command
-                    ACCEL_ID,              // Gravity Vector Feature Report ID
-                    0xC0,        // Feature flags (0 = default), C0 to enable change sensitivity relative
-                    0x01, 0x00,        // Change sensitivity (disabled)
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL & 0xFF)), // 32-bit Report interval in microseconds LSB to MSB
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 8 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 16 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 24 & 0xFF)),  
-                    0x00, 0x00, 0x00, 0x00,  // Batch interval (disabled)
-                    0x00, 0x00, 0x00, 0x00   // Sensor-specific config (default)
-                  };
-    
-    transmit_packet(BNO_ADDRESS << 1, data, 21);
+    if (motionActive) {
+        // C0 to enable change sensitivity relative
+        set_feature(ACCEL_ID, 0xC0, 0x0001, MOTION_REPORT_INTERVAL);
+    } else {
+        // no change sensitivity, every report is sent
+        set_feature(ACCEL_ID, 0x00, 0x0000, IDLE_REPORT_INTERVAL);
+    }
 }
 
 void enable_linear_acceleration(){
-    // https://www.ceva-ip.com/wp-content/uploads/SH-2-Reference-Manual.pdf
-    // 6.5.4 Set Feature Command (Page 65)
-    uint8_t data[] = {
-                    0x15, 0x00,        // SHTP header (length = 21 bytes) LSB then MSB
-                    bnoControlChannel,              // Channel (Sensor Hub Control)
-                    send_sequence++,              // Sequence number
-                    0xFD,              // Set Feature Command
-                    LINEAR_ACC_ID,              // Gravity Vector Feature Report ID
-                    0x00,        // Feature flags (0 = default)
-                    0x00, 0x00,        // Change sensitivity (disabled)
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL & 0xFF)), // 32-bit Report interval in microseconds LSB to MSB
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 8 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 16 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 24 & 0xFF)),  
-                    0x00, 0x00, 0x00, 0x00,  // Batch interval (disabled)
-                    0x00, 0x00, 0x00, 0x00   // Sensor-specific config (default)
-                  };
-    
-    transmit_packet(BNO_ADDRESS << 1, data, 21);
+    set_feature(LINEAR_ACC_ID, 0x00, 0x0000, GRAVITY_REPORT_INTERVAL);
 }
 
 void enable_rotation_vector() {
-    uint8_t data[] = {
-                    0x15, 0x00,        // SHTP header (length = 21 bytes) LSB then MSB
-                    bnoControlChannel,              // Channel (Sensor Hub Control)
-                    send_sequence++,              // Sequence number
-                    0xFD,              // Set Feature Command
-                    ROTATION_VECTOR_ID,              // Gravity Vector Feature Report ID
-                    0x00,        // Feature flags (0 = default)
-                    0x00, 0x00,        // Change sensitivity (disabled)
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL & 0xFF)), // 32-bit Report interval in microseconds LSB to MSB
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 8 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 16 & 0xFF)),
-                    ((uint8_t) (GRAVITY_REPORT_INTERVAL >> 24 & 0xFF)),  
-                    0x00, 0x00, 0x00, 0x00,  // Batch interval (disabled)
-                    0x00, 0x00, 0x00, 0x00   // Sensor-specific config (default)
-                  };
-    transmit_packet(BNO_ADDRESS << 1, data, 21);
+    set_feature(ROTATION_VECTOR_ID, 0x00, 0x0000, GRAVITY_REPORT_INTERVAL);
+}
+
+/* Track how much the accelerometer reading changes between samples and switch
+ * between the idle and motion report profiles. The motion profile is entered as
+ * soon as one sample changes by MOTION_ENTER_THRESHOLD, and is only left after
+ * IDLE_SAMPLE_COUNT samples in a row change by less than MOTION_EXIT_THRESHOLD.
+ * 
+ * @param rawX  Raw X component of the sample (Q8).
+ * @param rawY  Raw Y component of the sample (Q8).
+ * @param rawZ  Raw Z component of the sample (Q8).
+ */
+void updateMotionDetector(int16_t rawX, int16_t rawY, int16_t rawZ) {
+    long change = labs((long) rawX - lastAccRaw[0]) + labs((long) rawY - lastAccRaw[1]) + labs((long) rawZ - lastAccRaw[2]);
+    lastAccRaw[0] = rawX;
+    lastAccRaw[1] = rawY;
+    lastAccRaw[2] = rawZ;
+    if (!hasAccBaseline) {
+        // first sample, nothing to compare against yet
+        hasAccBaseline = 1;
+        return;
+    }
+    
+    if (motionActive) {
+        if (change < MOTION_EXIT_THRESHOLD) {
+            quietSamples++;
+            if (quietSamples >= IDLE_SAMPLE_COUNT) {
+                // settled, drop to the idle profile
+                motionActive = 0;
+                quietSamples = 0;
+                enable_accelerometer();
+            }
+        } else {
+            quietSamples = 0;
+        }
+    } else if (change >= MOTION_ENTER_THRESHOLD) {
+        // moving again, go back to the fast profile
+        motionActive = 1;
+        quietSamples = 0;
+        enable_accelerometer();
+    }
 }
 
 int strncmp(const char* str1, const char* str2) {
@@ -294,6 +375,21 @@ int readAdvertisement() {
     
 }
 
+/* Add a raw sample to the running totals of a sensor. Must be called between
+ * the sequence increments in processMessage().
+ * 
+ * @param totals    The totals of the sensor.
+ * @param rawX      Raw X component of the sample.
+ * @param rawY      Raw Y component of the sample.
+ * @param rawZ      Raw Z component of the sample.
+ */
+void addSample(volatile SensorTotals* totals, long rawX, long rawY, long rawZ) {
+    totals->sumX += rawX;
+    totals->sumY += rawY;
+    totals->sumZ += rawZ;
+    totals->count++;
+}
+
 void readReport(int index) {
     if (index >= numBytes) {
         // index out of bounds
@@ -313,8 +409,8 @@ void readReport(int index) {
            baseDelta |= (long) buffer[index++] << 8;
            baseDelta |= (long) buffer[index++] << 16;
            baseDelta |= (long) buffer[index++] << 24;
-           gravityVector.deltaTime += baseDelta;
-           accVector.deltaTime += baseDelta;
+           gravityTotals.deltaTime += baseDelta;
+           accTotals.deltaTime += baseDelta;
            readReport(index);
         } else if (reportID == GRAVITY_VECTOR_ID) {
             // https://www.ceva-ip.com/wp-content/uploads/SH-2-Reference-Manual.pdf
@@ -332,21 +428,7 @@ void readReport(int index) {
                 int16_t rawZ = (int16_t)((buffer[index]) | (buffer[index + 1] << 8));
                 index += 2;
 
-                // converts to floating point
-                if (gravityVector.average_count == 0) {
-                    // have not stored anything here yet
-                    gravityVector.x = ((int) rawX) * Q14_SCALE;
-                    gravityVector.y = ((int) rawY) * Q14_SCALE;
-                    gravityVector.z = ((int) rawZ) * Q14_SCALE;
-                } else {
-                    // merge with previous values
-                    float prevMultiplier = gravityVector.average_count / (gravityVector.average_count + 1.0f);
-                    float curMultiplier = 1 / (gravityVector.average_count + 1.0f);
-                    gravityVector.x = prevMultiplier * gravityVector.x + curMultiplier * (((int) rawX) * Q14_SCALE);
-                    gravityVector.y = prevMultiplier * gravityVector.y + curMultiplier * (((int) rawY) * Q14_SCALE);
-                    gravityVector.z = prevMultiplier * gravityVector.z + curMultiplier * (((int) rawZ) * Q14_SCALE);
-                }
-                gravityVector.average_count++;
+                addSample(&gravityTotals, rawX, rawY, rawZ);
             } else {
                 index += 6;
             }
@@ -379,21 +461,7 @@ void readReport(int index) {
                 int rawY = 2 * (jcomponent * kcomponent + realcomponent * icomponent);
                 int rawZ = 1 - 2 * (icomponent * icomponent + jcomponent * jcomponent);
 
-                // converts to floating point
-                if (gravityVector.average_count == 0) {
-                    // have not stored anything here yet
-                    gravityVector.x = ((int) rawX) * Q14_SCALE;
-                    gravityVector.y = ((int) rawY) * Q14_SCALE;
-                    gravityVector.z = ((int) rawZ) * Q14_SCALE;
-                } else {
-                    // merge with previous values
-                    float prevMultiplier = gravityVector.average_count / (gravityVector.average_count + 1.0f);
-                    float curMultiplier = 1 / (gravityVector.average_count + 1.0f);
-                    gravityVector.x = prevMultiplier * gravityVector.x + curMultiplier * (((int) rawX) * Q14_SCALE);
-                    gravityVector.y = prevMultiplier * gravityVector.y + curMultiplier * (((int) rawY) * Q14_SCALE);
-                    gravityVector.z = prevMultiplier * gravityVector.z + curMultiplier * (((int) rawZ) * Q14_SCALE);
-                }
-                gravityVector.average_count++;
+                addSample(&gravityTotals, rawX, rawY, rawZ);
             } else {
                 index += 12;
             }
@@ -411,21 +479,12 @@ void readReport(int index) {
                 int16_t rawZ = (int16_t)((buffer[index]) | (buffer[index + 1] << 8));
                 index += 2;
                 
-                // converts to floating point
-                if (accVector.average_count == 0) {
-                    // have not stored anything here yet
-                    accVector.x = ((int) rawX) * Q8_SCALE;
-                    accVector.y = ((int) rawY) * Q8_SCALE;
-                    accVector.z = ((int) rawZ) * Q8_SCALE;
-                } else {
-                    // merge with previous values
-                    float prevMultiplier = gravityVector.average_count / (gravityVector.average_count + 1.0f);
-                    float curMultiplier = 1 / (gravityVector.average_count + 1.0f);
-                    accVector.x = prevMultiplier * gravityVector.x + curMultiplier * (((int) rawX) * Q8_SCALE);
-                    accVector.y = prevMultiplier * gravityVector.y + curMultiplier * (((int) rawY) * Q8_SCALE);
-                    accVector.z = prevMultiplier * gravityVector.z + curMultiplier * (((int) rawZ) * Q8_SCALE);
+                if (resetStatus > 2) {
+                    // only switch profiles once the accelerometer has been enabled
+                    updateMotionDetector(rawX, rawY, rawZ);
                 }
-                accVector.average_count++;
+                
+                addSample(&accTotals, rawX, rawY, rawZ);
             } else {
                 index += 6;
             }
@@ -450,7 +509,10 @@ void processMessage() {
             resetStatus++;
         }
     } else if (channel == bnoInputChannel) {
+        // readers retry if the sequence changes while they copy the totals
+        sensorSequence++;
         readReport(4);
+        sensorSequence++;
     }
     
     if (resetStatus == 2) {
@@ -461,56 +523,120 @@ void processMessage() {
         //enable_linear_acceleration();
     }
     
+    // the next packet is most likely another report on the input channel
+    if (bnoInputChannel < MAX_CHANNELS && channelPacketSize[bnoInputChannel] > 0) {
+        readAheadSize = channelPacketSize[bnoInputChannel];
+    } else {
+        readAheadSize = SHTP_HEADER_SIZE;
+    }
+    
     lastTransferSize = numBytes;
     numBytes = 0;
     waiting = 0;
+    
+    if (PORTBbits.RB7 == 0) {
+        // more data became ready while this message was being read
+        _INT0IF = 1;
+    }
+}
+
+/* Take a consistent copy of a sensor's totals and turn everything added since the
+ * last read into an average. This never blocks the writer. If it is interrupted by
+ * processMessage() it just copies again.
+ * 
+ * @param totals    The totals of the sensor.
+ * @param reading   What was seen on the last read. This is updated.
+ * @param scale     Scale to convert raw samples to floating point.
+ * @param out       The averaged vector.
+ */
+void readSensor(volatile SensorTotals* totals, SensorReading* reading, float scale, GravityVector* out) {
+    SensorTotals now;
+    unsigned int sequence;
+    do {
+        sequence = sensorSequence;
+        now.sumX = totals->sumX;
+        now.sumY = totals->sumY;
+        now.sumZ = totals->sumZ;
+        now.deltaTime = totals->deltaTime;
+        now.count = totals->count;
+    } while ((sequence & 0b1) || sequence != sensorSequence);
+    
+    unsigned int count = now.count - reading->totals.count;
+    if (count > 0) {
+        // the sums wrap around, but the difference is still correct
+        float multiplier = scale / count;
+        reading->x = ((long) (now.sumX - reading->totals.sumX)) * multiplier;
+        reading->y = ((long) (now.sumY - reading->totals.sumY)) * multiplier;
+        reading->z = ((long) (now.sumZ - reading->totals.sumZ)) * multiplier;
+    }
+    out->x = reading->x;
+    out->y = reading->y;
+    out->z = reading->z;
+    out->deltaTime = now.deltaTime - reading->totals.deltaTime;
+    if (count > 0) {
+        out->average_count = count;
+    } else {
+        // no new samples, keep reporting the last average once there has been one
+        out->average_count = now.count != 0;
+    }
+    reading->totals = now;
 }
 
 void getGravityVector(GravityVector* out) {
-    // copy over gravity vector values
-    out->x = gravityVector.x;
-    out->y = gravityVector.y;
-    out->z = gravityVector.z;
-    out->deltaTime = gravityVector.deltaTime;
-    out->average_count = gravityVector.average_count;
-    // reset vector
-    gravityVector.deltaTime = 0;
-    gravityVector.average_count = 1;
+    readSensor(&gravityTotals, &gravityReading, Q14_SCALE, out);
 }
 
 void getAccVector(GravityVector* out) {
-    // copy over gravity vector values
-    out->x = accVector.x;
-    out->y = accVector.y;
-    out->z = accVector.z;
-    out->deltaTime = accVector.deltaTime;
-    out->average_count = accVector.average_count;
-    // reset vector
-    accVector.deltaTime = 0;
-    accVector.average_count = 1;
+    readSensor(&accTotals, &accReading, Q8_SCALE, out);
 }
 
 
-unsigned int receive_byte(uint8_t byte, int remainingBytes) {
-    buffer[numBytes++] = byte;
-    if (numBytes == 4) {
+/* Called from receive_byte() once the last byte of a message has arrived.
+ */
+void message_received() {
+    disarm_read_watchdog();
+    // parse the message outside of the I2C interrupt. waiting stays set until
+    // processMessage() is done, so the buffer won't be overwritten before then.
+    if (defer_work((unsigned long) processMessage) == 0) {
+        // deferred work queue is full, the watchdog tries again later
+        parsePending = 1;
+        arm_read_watchdog();
+    }
+}
+
+int receive_byte(uint8_t byte, int remainingBytes) {
+    if (numBytes < BUFFER_SIZE) {
+        buffer[numBytes++] = byte;
+    }
+    if (numBytes == SHTP_HEADER_SIZE) {
         // read total packet length
         
-        unsigned int byteIncrease = buffer[0] + (((unsigned int) buffer[1]) << 8);
+        unsigned int packetSize = buffer[0] + (((unsigned int) buffer[1]) << 8);
         if (buffer[1] >> 7 & 0b1) {
             // bit 15 signals that this is a continuation of a previous transfer
-            byteIncrease &= 0x7FFF;
+            packetSize &= 0x7FFF;
             numBytes = lastTransferSize;
+        } else if (buffer[2] < MAX_CHANNELS) {
+            channelPacketSize[buffer[2]] = packetSize;
         }
-        if (byteIncrease >= BUFFER_SIZE) {
-            return BUFFER_SIZE - 1;
+        if (packetSize < SHTP_HEADER_SIZE) {
+            // nothing after the header
+            packetSize = SHTP_HEADER_SIZE;
         }
-        return byteIncrease - 4; // 4 bytes is the size of the SHTP header
+        if (packetSize >= BUFFER_SIZE) {
+            packetSize = BUFFER_SIZE - 1;
+        }
+        // trim the read ahead if the packet is shorter, or extend it if it is longer
+        int change = (int) packetSize - (int) requestedBytes;
+        if (remainingBytes + change <= 0) {
+            // the packet was just the header, there won't be another byte to finish it
+            message_received();
+        }
+        return change;
     }
     
     if (remainingBytes == 0) {
-        processMessage();
-        
+        message_received();
     }
     
     return 0;
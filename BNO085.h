@@ -24,12 +24,21 @@ extern "C" {
     /* Initialize the bno085 and start receiving reports
      */
     void bno085_init();
-    /* Get the gravity vector from the device.
+    /* Get the gravity vector from the device. This is the average of every
+     * sample received since the last call, and deltaTime covers the same samples.
+     * If no samples have arrived, the last average is returned with an
+     * average_count of 1. The copy is always consistent without disabling
+     * interrupts.
      * 
      * @param out   The gravity vector
      */
     void getGravityVector(GravityVector* out);
     
+    /* Get the acceleration vector from the device. Works the same way as
+     * getGravityVector().
+     * 
+     * @param out   The acceleration vector
+     */
     void getAccVector(GravityVector* out);
 
 
@@ -12,6 +12,7 @@
 #include "stdio.h"      // For NULL
 
 #define MAX_EVENTS 3 // maximum number of events that can be registered
+#define MAX_DEFERRED_WORK 4 // maximum number of functions waiting in the deferred work queue
 
 // pool of transmission object that can be allocated for the queue
 // If the queue is full, 2 extra transmissions are needed for the active
@@ -25,12 +26,18 @@ volatile Transmission activeTransmission;
 // The current data byte that is being sent/received
 volatile unsigned int curDataIndex = 0; 
 
+// Transmissions queued and finished so far, these are the tickets of i2c_ticket()
+volatile unsigned int transmissionsQueued = 0;
+volatile unsigned int transmissionsDone = 0;
+
 // Whether I2C is initialized or not.
 uint8_t initialized = 0;
 
 // variables to keep track of any I2C interrupts when the interrupt is disabled.
 volatile uint8_t I2CInterruptQueued = 0;
 volatile uint8_t I2CInterruptEnabled = 1;
+// How many disableInterrupts() calls haven't been matched by enableInterrupts() yet
+volatile uint8_t interruptsDisabled = 0;
 
 // The current I2C transmission stage
 enum TransmissionStage {
@@ -40,7 +47,7 @@ enum TransmissionStage {
 enum TransmissionStage stage = NONE;
 
 // a function that takes in the byte received, number of remaining bytes, and returns the number of additional bytes to be read
-typedef unsigned int receiveEvent(uint8_t, int); 
+typedef int receiveEvent(uint8_t, int); 
 
 void handleMI2CInterrupt();
 
@@ -48,12 +55,23 @@ volatile unsigned long eventAddresses[MAX_EVENTS]; // addresses of event functio
 volatile uint8_t i2cAddresses[MAX_EVENTS]; // I2C addresses to match the eventAddresses
 volatile int numEvents = 0; // The number of events registered
 
+// a function that takes in the stream's context and the index of a byte, and returns that byte
+typedef uint8_t streamProducer(uint8_t*, unsigned int);
+
+// a function that is run later from the deferred work software interrupt
+typedef void deferredWork(void);
+
+volatile unsigned long deferredAddresses[MAX_DEFERRED_WORK]; // addresses of functions waiting to be run
+volatile uint8_t deferredHead = 0; // next slot to post to, only changed by defer_work()
+volatile uint8_t deferredTail = 0; // next slot to run, only changed by _SI2C1Interrupt
+
 /* Register a function to be called when data is received from I2C.
- * The function should be in the form: unsigned int receiveEvent(uint8_t, int);
+ * The function should be in the form: int receiveEvent(uint8_t, int);
  * The first parameter is the byte received, and the second parameter is the
  * number of bytes remaining in the transmission. The function should return the
- * number of bytes to extend the packet by. If you have a set packet length,
- * always return 0.
+ * number of bytes to extend the packet by, or a negative number to shorten it.
+ * A read can't be shortened to fewer bytes than have already been received.
+ * If you have a set packet length, always return 0.
  * 
  * @param i2cAddress        The address of the I2C device that this event will fire for.
  * @param functionAddress   The address of the function to be called.
@@ -132,9 +150,11 @@ void free_transmission(uint8_t index) {
 /* Disable I2C relevant interrupts.
  */
 void disableInterrupts() {
+    interruptsDisabled++;
     I2CInterruptEnabled = 0;
-    // these 2 used for the BNO085
-    _T1IE = 0;
+    // deferred work may queue transmissions
+    _SI2C1IE = 0;
+    // used for the BNO085
     _INT0IE = 0;
 }
 
@@ -147,11 +167,17 @@ uint8_t isI2CReady() {
 }
 
 /* Enable I2C relevant interrupts, and force the MI2C1 interrupt if one was missed.
+ * Calls nest, so if this ends a disableInterrupts() made inside another one
+ * (e.g. the MI2C1 interrupt loading a transmission while queue_transmission()
+ * is running) the interrupts stay off until the outer one ends.
  */
 void enableInterrupts() {
-    // these 2 are for the BNO085
-    _T1IE = 1;
+    if (--interruptsDisabled != 0) {
+        return;
+    }
+    // used for the BNO085
     _INT0IE = 1;
+    _SI2C1IE = 1;
     
     I2CInterruptEnabled = 1;
     if (I2CInterruptQueued) {
@@ -176,6 +202,46 @@ int loadNextTransmission() {
     return 0;
 }
 
+/* Put a transmission in the queue and start sending if I2C is idle.
+ * Waits for room if the queue is full instead of dropping the transmission,
+ * so this can't be called between disableInterrupts() and enableInterrupts().
+ * 
+ * @param transmission  The transmission to send, it is copied into the queue.
+ */
+void queue_transmission(Transmission* transmission) {
+    disableInterrupts();
+    while (getQueueSize() >= MAX_QUEUE_SIZE) {
+        // let the MI2C1 interrupt send some of the queue
+        enableInterrupts();
+        disableInterrupts();
+    }
+    uint8_t transmissionIndex = 255;
+    while (transmissionIndex == 255)
+        transmissionIndex = allocate_transmission();
+    transmission_pool[transmissionIndex] = *transmission;
+    
+    if (enqueue(transmissionIndex) == 0) {
+        free_transmission(transmissionIndex);
+    } else {
+        transmissionsQueued++;
+    }
+    
+    
+    enableInterrupts();
+    
+    if (getQueueSize() > MAX_QUEUE_SIZE - 4) {
+        // queue is getting full, force an interrupt jic one was missed
+        if (isI2CReady()) {
+            handleMI2CInterrupt();
+        }
+    }
+    
+    
+    if (stage == NONE) {
+        initiateTransmission();
+    }
+}
+
 /* Send or receive data through I2C
  * 
  * @param address_RW    The least significant bit is for read / not write, and 
@@ -229,29 +295,50 @@ void transceive_packet(uint8_t address, uint8_t data[], unsigned int data_size,
         // reading data
         transmission.address_RW = (address << 1) | 0b1 ;
     }
-    disableInterrupts();
-    uint8_t transmissionIndex = 255;
-    while (transmissionIndex == 255)
-        transmissionIndex = allocate_transmission();
-    transmission_pool[transmissionIndex] = transmission;
+    transmission.copied = transmission.data_size;
+    transmission.buffer = NULL;
+    transmission.producer = 0;
+    queue_transmission(&transmission);
+}
+
+/* Send data through I2C, copying data and sending buffer from the caller's memory.
+ * 
+ * @param address_RW    The address of the device to write to, shifted left 1 (write bit zero).
+ * @param data[]        A short header to be copied, e.g. the register address. Can be 0.
+ * @param data_size     The size of the header.
+ * @param buffer[]      The data to be sent straight from the caller's memory.
+ * @param buffer_size   The size of buffer.
+ */
+void transmit_buffer(uint8_t address_RW, uint8_t data[], unsigned int data_size, uint8_t buffer[], unsigned int buffer_size) {
+    transmit_stream(address_RW, data, data_size, 0, buffer, buffer_size);
+}
+
+/* Send data through I2C, copying data and making the rest from the I2C interrupt.
+ * 
+ * @param address_RW        The address of the device to write to, shifted left 1 (write bit zero).
+ * @param data[]            A short header to be copied, e.g. the register address. Can be 0.
+ * @param data_size         The size of the header.
+ * @param producerAddress   The address of the function making the bytes, or 0 to send context as is.
+ * @param context           Passed to the producer, e.g. the data it is made from.
+ * @param stream_size       The number of bytes to make.
+ */
+void transmit_stream(uint8_t address_RW, uint8_t data[], unsigned int data_size, unsigned long producerAddress, uint8_t* context, unsigned int stream_size) {
+    Transmission transmission;
     
-    if (enqueue(transmissionIndex) == 0) {
-        free_transmission(transmissionIndex);
+    if (data_size > MAX_DATA_SIZE) {
+        data_size = MAX_DATA_SIZE;
     }
-    
-    
-    enableInterrupts();
-    
-    if (getQueueSize() > MAX_QUEUE_SIZE - 4) {
-        // queue is getting full, force an interrupt jic one was missed
-        if (isI2CReady()) {
-            handleMI2CInterrupt();
-        }
+    for (int i = 0; i < data_size; i++) {
+        transmission.data[i] = data[i];
     }
-    
-    
-    if (stage == NONE) {
-        initiateTransmission();
+    transmission.address_RW = address_RW & ~0b1;
+    transmission.copied = data_size;
+    transmission.buffer = context;
+    transmission.producer = producerAddress;
+    transmission.data_size = data_size + stream_size;
+    transmission.read_bytes = 0;
+    if (transmission.data_size > 0) {
+        queue_transmission(&transmission);
     }
 }
 
@@ -260,7 +347,14 @@ void transceive_packet(uint8_t address, uint8_t data[], unsigned int data_size,
 void transmitNextData() {
     // make sure read is false
     if (activeTransmission.address_RW | 0b0) {
-        I2C1TRN = activeTransmission.data[curDataIndex++];
+        if (curDataIndex < activeTransmission.copied) {
+            I2C1TRN = activeTransmission.data[curDataIndex++];
+        } else if (activeTransmission.producer) {
+            streamProducer* f = (streamProducer*) activeTransmission.producer;
+            I2C1TRN = f(activeTransmission.buffer, curDataIndex++ - activeTransmission.copied);
+        } else {
+            I2C1TRN = activeTransmission.buffer[curDataIndex++ - activeTransmission.copied];
+        }
     }
 }
 
@@ -335,6 +429,7 @@ void handleMI2CInterrupt() {
             I2C1CONbits.RCEN = 1; // enable receive
         }
     } else if (stage == DISABLING && I2C1CONbits.PEN == 0 && I2C1STATbits.P == 1) {
+        transmissionsDone++;
         if (getQueueSize() > 0) {
             // more data to be sent
             initiateTransmission();
@@ -382,6 +477,53 @@ void __attribute__((__interrupt__,__auto_psv__)) _MI2C1Interrupt(void) {
     }
 }
 
+/* Queue a function to be run later from the deferred work software interrupt.
+ * 
+ * @param functionAddress   The address of the function to be called.
+ * @returns                 1 if the function was queued, 0 if the queue is full.
+ */
+uint8_t defer_work(unsigned long functionAddress) {
+    uint8_t nextHead = (deferredHead + 1) % MAX_DEFERRED_WORK;
+    if (nextHead == deferredTail) {
+        // full
+        return 0;
+    }
+    deferredAddresses[deferredHead] = functionAddress;
+    deferredHead = nextHead;
+    // the slave interrupt is never used in master mode, so it is used as a software interrupt
+    _SI2C1IF = 1;
+    return 1;
+}
+
+/* Runs the deferred work at low priority so other interrupts can preempt it.
+ */
+void __attribute__((__interrupt__,__auto_psv__)) _SI2C1Interrupt(void) {
+    _SI2C1IF = 0; // clear interrupt
+    while (deferredTail != deferredHead) {
+        deferredWork* f = (deferredWork*) deferredAddresses[deferredTail];
+        deferredTail = (deferredTail + 1) % MAX_DEFERRED_WORK;
+        f();
+    }
+}
+
+/* Get a ticket for the last transmission that was queued.
+ * 
+ * @returns     The ticket, pass it to i2c_done().
+ */
+unsigned int i2c_ticket() {
+    return transmissionsQueued;
+}
+
+/* Check if a transmission has been sent.
+ * 
+ * @param ticket    The ticket from i2c_ticket().
+ * @returns         True if that transmission and all before it are finished.
+ */
+uint8_t i2c_done(unsigned int ticket) {
+    // the difference still works after the counters wrap around
+    return (int) (transmissionsDone - ticket) >= 0;
+}
+
 /* Send a write command synchronously through I2C. 
 * This will halt all processing until the transmission is complete
 * 
@@ -419,6 +561,9 @@ void init_i2c() {
     _MI2C1IF = 0;           // clear interrupt flag
     _MI2C1IE = 1;           // enable interrupt later
     _MI2C1IP = 6;           // higher interrupt priority
+    _SI2C1IF = 0;           // clear deferred work interrupt flag
+    _SI2C1IP = 1;           // deferred work runs below everything else
+    _SI2C1IE = 1;           // enable deferred work interrupt
     I2C1CONbits.I2CEN = 1;  // enable
     
     initialized = 1;
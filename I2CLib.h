@@ -16,11 +16,12 @@ extern "C" {
     void init_i2c(void);
     
     /* Register a function to be called when data is received from I2C.
-    * The function should be in the form: unsigned int receiveEvent(uint8_t, int);
+    * The function should be in the form: int receiveEvent(uint8_t, int);
     * The first parameter is the byte received, and the second parameter is the
     * number of bytes remaining in the transmission. The function should return the
-    * number of bytes to extend the packet by. If you have a set packet length,
-    * always return 0.
+    * number of bytes to extend the packet by, or a negative number to shorten it.
+    * A read can't be shortened to fewer bytes than have already been received.
+    * If you have a set packet length, always return 0.
     * 
     * @param i2cAddress        The address of the I2C device that this event will fire for.
     * @param functionAddress   The address of the function to be called.
@@ -32,6 +33,9 @@ extern "C" {
     * Start >> (address_RW) >> (read read_bytes number of bytes) >> Stop
     * Read bit is zero (write):
     * Start >> (address_RW) >> (data[0] -> data[dataW_size-1]) >> Stop
+    * At most MAX_DATA_SIZE bytes are copied and sent, use transmit_buffer() or
+    * transmit_stream() for more.
+    * If the queue is full this waits for the transmissions in front to be sent.
     * 
     * @param address_RW    The least significant bit is for read / not write, and 
     *                      the 7 most significant bits are for the address.
@@ -41,6 +45,35 @@ extern "C" {
     */
    void transmit_packet(uint8_t address_RW, uint8_t data[], unsigned int data_size);
    
+   /* Send data through I2C without copying most of it. This function sends the following on I2C:
+    * Start >> (address_RW) >> (data[0] -> data[data_size-1]) >> (buffer[0] -> buffer[buffer_size-1]) >> Stop
+    * data is copied like transmit_packet(), but buffer is read while it is being sent,
+    * so it has to stay in memory until then. Changes made to it before that are sent too.
+    * 
+    * @param address_RW    The address of the device to write to, shifted left 1 (write bit zero).
+    * @param data[]        A short header to be copied, e.g. the register address. Can be 0.
+    * @param data_size     The size of the header.
+    * @param buffer[]      The data to be sent straight from the caller's memory.
+    * @param buffer_size   The size of buffer.
+    */
+   void transmit_buffer(uint8_t address_RW, uint8_t data[], unsigned int data_size, uint8_t buffer[], unsigned int buffer_size);
+   
+   /* Send data through I2C, making most of it while it is being sent. This function sends the following on I2C:
+    * Start >> (address_RW) >> (data[0] -> data[data_size-1]) >> (producer(context, 0) -> producer(context, stream_size-1)) >> Stop
+    * data is copied like transmit_packet(). The producer is called from the I2C interrupt
+    * for every byte after it, so it has to be quick, and context has to stay in memory until then.
+    * The function should be in the form: uint8_t streamProducer(uint8_t*, unsigned int);
+    * The first parameter is context, and the second is the index of the byte to make.
+    * 
+    * @param address_RW        The address of the device to write to, shifted left 1 (write bit zero).
+    * @param data[]            A short header to be copied, e.g. the register address. Can be 0.
+    * @param data_size         The size of the header.
+    * @param producerAddress   The address of the function making the bytes.
+    * @param context           Passed to the producer, e.g. the data it is made from.
+    * @param stream_size       The number of bytes to make.
+    */
+   void transmit_stream(uint8_t address_RW, uint8_t data[], unsigned int data_size, unsigned long producerAddress, uint8_t* context, unsigned int stream_size);
+   
    /* Read data through I2C. This function sends the following on I2C:
     * Start >> (address + write) >> (data[0] -> data[dataW_size-1]) >> Repeated Start >> (read read_bytes number of bytes) >> Stop
     * If data_size is 0, transmit_packet((address << 1) | 0b1, 0, read_bytes) is used
@@ -65,6 +98,32 @@ extern "C" {
    
    // Get the number of transmissions currently queued.
    int getTransmissionsUsed();
+   
+   /* Get a ticket for the last transmission queued, e.g. the last packet of a frame.
+    * Transmissions are sent in order, so once it is done everything before it is too.
+    * 
+    * @returns     The ticket, pass it to i2c_done().
+    */
+   unsigned int i2c_ticket();
+   
+   /* Check if a transmission has been sent, without waiting for it.
+    * 
+    * @param ticket    The ticket from i2c_ticket().
+    * @returns         True if that transmission and all before it are finished.
+    */
+   uint8_t i2c_done(unsigned int ticket);
+   
+   /* Queue a function to be run later at low priority instead of inside the
+    * calling interrupt. Use this from receive events to move slow processing
+    * out of the I2C interrupt, which should only move bytes.
+    * The function should be in the form: void deferredWork(void);
+    * Queued functions are run in order from a priority 1 software interrupt.
+    * Only call this from one interrupt priority (e.g. the receive events).
+    * 
+    * @param functionAddress   The address of the function to be called.
+    * @returns                 1 if the function was queued, 0 if the queue is full.
+    */
+   uint8_t defer_work(unsigned long functionAddress);
 
 #ifdef	__cplusplus
 }
@@ -11,11 +11,40 @@
 #include "xc.h"
 #include <stdio.h>
 #include "LED_144_Lib.h"
+#include "I2CLib.h"
 
 #include "stdint.h"
 
 //Define the slave address, 0xE8
 #define SLAVE_ADDRESS 0b11101000
+#define BLINK_REGISTER 0x12 //first blink control register of a frame, 2 per row like the LED enables
+#define BLINK_PERIOD 0b001 //blink period time (BPT) in the display option register
+#define FULL_FRAME_CELLS 96 //send the whole frame when more pixels than this changed
+#define SPAN_MERGE_GAP 3 //resend up to this many unchanged pixels instead of starting a new write
+#define MAX_SPANS 10 //send the whole frame instead of more writes than this, so a frame fits in the I2C queue
+
+#define FRAMES 2 //frames drawn into, one is displayed while the other is written
+#define AUTOPLAY_MODE 0x08 //auto frame play in the configuration register, the start frame goes in bits 2:0
+
+#define SUBCELL_STEPS 16 //sub-cell offsets are rounded to 1/SUBCELL_STEPS of a cell
+
+//share of a particle's brightness (out of 256) drawn in the next cell over, by its
+//offset from the center of its cell in 1/SUBCELL_STEPS of a cell. Past half a cell it moves
+const uint8_t subcellShare[SUBCELL_STEPS / 2 + 1] = {0, 16, 32, 48, 64, 80, 96, 112, 128};
+
+//brightness of each breathing frame (out of 256), it loops back to the first one
+const uint8_t breathLevels[ANIMATION_FRAMES] = {255, 215, 170, 140, 170, 215};
+
+uint8_t backFrame = 1; //frame being written, the other one is on display
+uint8_t autoplaying = 0; //the chip is playing the animation frames by itself
+uint8_t enablesSent = 0; //bit per frame, the LED enable block has been sent since led_init()
+uint16_t pendingBlink[FRAMES]; //blink rows each frame hasn't been sent yet
+uint16_t pendingDirty[FRAMES][ROWS]; //pixels each frame hasn't been sent yet
+uint8_t blinksEnabled = 1; //blink changes are sent, see led_send_blinks()
+uint8_t antialiased = 0; //particles are drawn at their sub-cell position, see led_set_antialias()
+uint8_t lastDrawn[ROWS * COLS]; //the pixels render_subcell() drew before, to find the ones that changed
+uint8_t snapshot[FRAME_SIZE]; //the pixel data's frame as it was when write_all() was called
+unsigned int renderTicket = 0; //I2C ticket of the last flip, done once that frame is on display
 
 /*
  * This function doesn't take in arguments or return anything
@@ -40,6 +69,10 @@ void led_init(void){
     data[0] = 0x01; //picture display register
     data[1] = 0x00; //go to frame one
     transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    data[0] = 0x05; //display option register
+    data[1] = 0x08 | BLINK_PERIOD; //blink enable, the blink registers pick the LEDs
+    transmit_packet(SLAVE_ADDRESS, data, 2);
      
     data[0] = 0x0A; //go to the shut down register
     data[1] = 0x00; //shutdown
@@ -49,10 +82,12 @@ void led_init(void){
     data[1] = 0x01; //normal operation
     transmit_packet(SLAVE_ADDRESS, data, 2);
     
-    data[0] = 0xFD; //Choose a frame
-    data[1] = 0x00; //Go to frame 1
-    transmit_packet(SLAVE_ADDRESS, data, 2);
-    
+    //frame 1 is displayed, write_all() draws into frame 2 and flips to it
+    backFrame = 1;
+    autoplaying = 0;
+    enablesSent = 0;
+    blinksEnabled = 1;
+    antialiased = 0;
     write_all();
 }
 
@@ -108,31 +143,379 @@ void led_write(uint8_t row, uint8_t column, uint8_t brightness){
 }
 
 
- void write_all () {
-      int i = 0, j = 0, k = 0;
-     uint8_t data[146];
-       for(i = 0; i<146; i++){
-           data[i] = 0;
-       }
-               
-      data[0] = 0xFD; //Select a frame register
-      data[0] = 0x00; //Go to frame one
-      transmit_packet(SLAVE_ADDRESS, data, 2);
-         
-     data[0] = 0x00;
-     for( i = 1; i<= 18; i++){
-         data[i] = 0xFF;
-         
-     }
-     transmit_packet(SLAVE_ADDRESS, data, 19);
-     
-       //start with the brightness
-    data[0] = 0x24;
-    i = 1;
+/*
+ * Sends the brightness of the cells from first to last (inclusive) in one write
+ * The PWM registers are in the same order as the cells, so the chip's
+ * auto increment walks through them. The brightness is sent straight out
+ * of the snapshot, only the register address is copied
+ */
+void write_span(uint8_t first, uint8_t last){
+    if(first == 0 && last == ROWS * COLS - 1){
+        //the frame already starts with the first register
+        transmit_buffer(SLAVE_ADDRESS, 0, 0, snapshot, FRAME_SIZE);
+        return;
+    }
+    uint8_t reg = FRAME_REGISTER + first;
+    transmit_buffer(SLAVE_ADDRESS, &reg, 1, &snapshot[1 + first], last - first + 1);
+}
+
+/*
+ * Finds the runs of changed pixels marked in dirty, joining runs that are close together
+ * If send is set each run is written, otherwise they are only counted
+ * Returns the number of runs
+ */
+uint8_t find_spans(uint16_t dirty[], uint8_t send){
+    uint8_t j, k, spans = 0;
+    int start = -1, end = -1;
+    for(j = 0; j < ROWS; j++){
+        for(k = 0; k < COLS; k++){
+            if(dirty[j] >> k & 0b1){
+                int cell = CELL(k, j);
+                if(start >= 0 && cell - end - 1 > SPAN_MERGE_GAP){
+                    if(send){
+                        write_span(start, end);
+                    }
+                    spans++;
+                    start = -1;
+                }
+                if(start < 0){
+                    start = cell;
+                }
+                end = cell;
+            }
+        }
+    }
+    if(start >= 0){
+        if(send){
+            write_span(start, end);
+        }
+        spans++;
+    }
+    return spans;
+}
+
+/*
+ * Sends the brightness of the pixels marked in dirty, one write per run of
+ * changed pixels, or the whole frame if most of them changed or they are
+ * spread over more than MAX_SPANS runs
+ */
+void write_pixels(uint16_t dirty[]){
+    uint8_t j, count = 0;
+    for(j = 0; j < ROWS; j++){
+        for(uint16_t bits = dirty[j]; bits != 0; bits &= bits - 1){
+            count++;
+        }
+    }
+    if(count == 0){
+        return;
+    }
+    if(count > FULL_FRAME_CELLS || find_spans(dirty, 0) > MAX_SPANS){
+        write_span(0, ROWS * COLS - 1);
+        return;
+    }
+    find_spans(dirty, 1);
+}
+
+/*
+ * Finds the share of brightness a particle gives the next cell over along one axis
+ * offset is the particle's raw relative position (POSITION_Q), step is set to the way it leans
+ */
+uint8_t subcellWeight(int16_t offset, int8_t* step){
+    *step = offset < 0 ? -1 : 1;
+    uint16_t index = (offset < 0 ? -(long) offset : offset) >> (POSITION_Q - 4); //1/16 of a cell
+    if(index > SUBCELL_STEPS / 2){
+        index = SUBCELL_STEPS / 2;
+    }
+    return subcellShare[index];
+}
+
+/*
+ * Checks if a particle can lean into a cell: it is on the display and empty
+ */
+uint8_t canLean(uint8_t* pixels, int8_t x, int8_t y){
+    return x >= 0 && x < COLS && y >= 0 && y < ROWS && pixels[1 + CELL(x, y)] == 0;
+}
+
+/*
+ * Adds brightness to a cell of the snapshot, stopping at the brightest value
+ */
+void addBrightness(uint8_t cell, uint8_t brightness){
+    uint16_t sum = snapshot[1 + cell] + brightness;
+    snapshot[1 + cell] = sum > 0xFF ? 0xFF : sum;
+}
+
+/*
+ * Draws every particle into the snapshot split between its cell and the empty
+ * cells it leans toward, so it moves smoothly between cells
+ * Bit x of changed[y] is set if the pixel at (x, y) is different from the last snapshot
+ */
+void render_subcell(uint16_t changed[]){
+    uint8_t* pixels = getFrame();
+    uint8_t x, y, cell;
+    
+    for(cell = 0; cell < ROWS * COLS; cell++){
+        lastDrawn[cell] = snapshot[1 + cell];
+        snapshot[1 + cell] = 0;
+    }
+    snapshot[0] = FRAME_REGISTER;
+    
+    for(y = 0; y < ROWS; y++){
+        for(x = 0; x < COLS; x++){
+            cell = CELL(x, y);
+            uint8_t brightness = pixels[1 + cell];
+            if(brightness == 0){
+                continue;
+            }
+            int8_t dx, dy;
+            uint8_t shareX = subcellWeight(getRawRelativePositionXFixed(x, y), &dx);
+            uint8_t shareY = subcellWeight(getRawRelativePositionYFixed(x, y), &dy);
+            if(!canLean(pixels, x + dx, y)){
+                shareX = 0;
+            }
+            if(!canLean(pixels, x, y + dy)){
+                shareY = 0;
+            }
+            
+            //split along x, then split both halves along y
+            uint8_t sideX = (uint16_t) brightness * shareX >> 8;
+            uint8_t home = brightness - sideX;
+            uint8_t homeY = (uint16_t) home * shareY >> 8;
+            uint8_t sideXY = (uint16_t) sideX * shareY >> 8;
+            if(sideXY != 0 && !canLean(pixels, x + dx, y + dy)){
+                //the corner is taken, keep that part beside the particle
+                sideXY = 0;
+            }
+            addBrightness(cell, home - homeY);
+            if(sideX != 0){
+                addBrightness(CELL(x + dx, y), sideX - sideXY);
+            }
+            if(homeY != 0){
+                addBrightness(CELL(x, y + dy), homeY);
+            }
+            if(sideXY != 0){
+                addBrightness(CELL(x + dx, y + dy), sideXY);
+            }
+        }
+    }
+    
+    for(y = 0; y < ROWS; y++){
+        changed[y] = 0;
+        for(x = 0; x < COLS; x++){
+            cell = CELL(x, y);
+            if(snapshot[1 + cell] != lastDrawn[cell]){
+                changed[y] |= 1u << x;
+            }
+        }
+    }
+}
+
+/*
+ * Selects a frame and makes sure its LEDs are enabled
+ */
+void select_frame(uint8_t data[], uint8_t frame){
+    data[0] = 0xFD; //Choose a frame
+    data[1] = frame;
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    if(!(enablesSent >> frame & 0b1)){
+        data[0] = 0x00;
+        for(uint8_t i = 1; i <= 18; i++){
+            data[i] = 0xFF;
+        }
+        transmit_packet(SLAVE_ADDRESS, data, 19);
+        enablesSent |= 1 << frame;
+    }
+}
+
+void write_all () {
+    int i = 0, j = 0;
+    uint8_t data[ROWS * 2 + 1]; //big enough for the LED enable or blink block
+    uint8_t frame;
+    
+    //the snapshot is still being sent until the last frame is up
+    while(!led_ready());
+    
+    //something is being drawn again, so take the display back from the animation
+    if(autoplaying){
+        led_stop_autoplay();
+    }
+    
+    //drawn at sub-cell positions, the pixels that changed come from the drawing
+    //instead of the pixel data
+    uint16_t changed[ROWS];
+    if(antialiased){
+        render_subcell(changed);
+    }
+    
+    //every change has to reach both frames, the back frame gets it now and the
+    //displayed one after the next flip
+    uint16_t blinkRows = takeBlinkChanges();
+    uint16_t pending = 0;
+    for(j = 0; j < ROWS; j++){
+        uint16_t dirty = takeDirtyRow(j);
+        if(antialiased){
+            dirty = changed[j];
+        }
+        for(frame = 0; frame < FRAMES; frame++){
+            pendingDirty[frame][j] |= dirty;
+        }
+        pending |= pendingDirty[backFrame][j];
+    }
+    for(frame = 0; frame < FRAMES; frame++){
+        pendingBlink[frame] |= blinkRows;
+    }
+    
+    //nothing is waiting for the back frame, so it already matches the displayed one
+    if(pending == 0 && (pendingBlink[backFrame] == 0 || !blinksEnabled) && (enablesSent >> backFrame & 0b1)){
+        return;
+    }
+    
+    //every LED is always enabled, so the enable block only has to go out once per frame
+    select_frame(data, backFrame);
+    
+    //the chip blinks the LEDs itself, only send the rows whose blink bits changed
+    //while blink updates are off they stay pending until they are turned back on
+    blinkRows = blinksEnabled ? pendingBlink[backFrame] : 0;
+    pendingBlink[backFrame] &= ~blinkRows;
+    if (blinkRows != 0) {
+        uint8_t first = 0, last = ROWS - 1;
+        while (!(blinkRows >> first & 0b1)) {
+            first++;
+        }
+        while (!(blinkRows >> last & 0b1)) {
+            last--;
+        }
+        //one write covers every row from the first to the last changed one
+        data[0] = BLINK_REGISTER + first * 2;
+        i = 1;
+        for(j = first; j <= last; j++){
+            uint16_t blink = getBlinkRow(j);
+            data[i++] = blink & 0xFF; //columns 1-8
+            data[i++] = blink >> 8;   //columns 9-16
+        }
+        transmit_packet(SLAVE_ADDRESS, data, i);
+    }
+    
+    //the pixel data keeps changing while this frame goes out, so send a copy
+    if(!antialiased){
+        uint8_t* pixels = getFrame();
+        for(i = 0; i < FRAME_SIZE; i++){
+            snapshot[i] = pixels[i];
+        }
+    }
+    write_pixels(pendingDirty[backFrame]);
     for(j = 0; j < ROWS; j++){
-        for(k = 0; k< COLS; k++){
-            data[i++] = getDisplayBrightness(k, j);
+        pendingDirty[backFrame][j] = 0;
+    }
+    
+    //the flip is queued behind the upload, so the new frame shows up all at once
+    data[0] = 0xFD; //Choose a frame
+    data[1] = 0x0B; //Go to the function register
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    data[0] = 0x01; //picture display register
+    data[1] = backFrame;
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    renderTicket = i2c_ticket();
+    backFrame ^= 1;
+}
+
+void led_set_antialias(uint8_t enabled){
+    antialiased = enabled;
+    //the frames were drawn the other way, send every pixel again
+    for(uint8_t frame = 0; frame < FRAMES; frame++){
+        for(uint8_t j = 0; j < ROWS; j++){
+            pendingDirty[frame][j] = 0xFFFF >> (16 - COLS);
         }
     }
-     transmit_packet(SLAVE_ADDRESS, data, 145);
- }
\ No newline at end of file
+}
+
+void led_send_blinks(uint8_t enabled){
+    blinksEnabled = enabled;
+}
+
+uint8_t led_ready(void){
+    return i2c_done(renderTicket);
+}
+
+/*
+ * Selects an animation frame and sends it the blink bits of the current picture
+ */
+void load_frame_blinks(uint8_t index){
+    uint8_t data[ROWS * 2 + 1];
+    select_frame(data, ANIMATION_FIRST_FRAME + index);
+    
+    //the animation keeps the pixels that are blinking right now
+    data[0] = BLINK_REGISTER;
+    for(uint8_t j = 0; j < ROWS; j++){
+        uint16_t blink = getBlinkRow(j);
+        data[j * 2 + 1] = blink & 0xFF; //columns 1-8
+        data[j * 2 + 2] = blink >> 8;   //columns 9-16
+    }
+    transmit_packet(SLAVE_ADDRESS, data, ROWS * 2 + 1);
+}
+
+unsigned int led_load_frame(uint8_t index, uint8_t brightness[]){
+    load_frame_blinks(index);
+    uint8_t reg = FRAME_REGISTER;
+    transmit_buffer(SLAVE_ADDRESS, &reg, 1, brightness, ROWS * COLS);
+    return i2c_ticket();
+}
+
+/*
+ * Makes one byte of a breathing frame while it is being sent
+ * level points at the frame's entry in breathLevels
+ */
+uint8_t breathingByte(uint8_t* level, unsigned int cell){
+    return (uint16_t) getFrame()[1 + cell] * *level >> 8;
+}
+
+void led_load_breathing(void){
+    for(uint8_t frame = 0; frame < ANIMATION_FRAMES; frame++){
+        load_frame_blinks(frame);
+        uint8_t reg = FRAME_REGISTER;
+        transmit_stream(SLAVE_ADDRESS, &reg, 1, (unsigned long) &breathingByte, (uint8_t*) &breathLevels[frame], ROWS * COLS);
+        //each frame holds the bus for a few ms, so let it go out before queueing
+        //the next one instead of filling the queue the sensor reads go through
+        unsigned int ticket = i2c_ticket();
+        while(!i2c_done(ticket));
+    }
+}
+
+void led_autoplay(uint8_t frames, uint8_t delay){
+    uint8_t data[] = {
+        0xFD, //pick a frame
+        0x0B //Go to the function register
+    };
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    data[0] = 0x02; //auto play control register 1
+    data[1] = frames; //loop forever (bits 6:4 are 0), play this many frames
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    data[0] = 0x03; //auto play control register 2
+    data[1] = delay; //frame delay time
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    data[0] = 0x00; //configuration register
+    data[1] = AUTOPLAY_MODE | ANIMATION_FIRST_FRAME; //auto frame play from the first animation frame
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    //transmit_packet() waits for room in the queue, so the chip gets the write
+    autoplaying = 1;
+}
+
+void led_stop_autoplay(void){
+    uint8_t data[] = {
+        0xFD, //pick a frame
+        0x0B //Go to the function register
+    };
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    data[0] = 0x00; //configuration register
+    data[1] = 0x00; //picture mode
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    
+    data[0] = 0x01; //picture display register
+    data[1] = backFrame ^ 1; //show the last frame write_all() drew
+    transmit_packet(SLAVE_ADDRESS, data, 2);
+    autoplaying = 0;
+}
@@ -18,6 +18,7 @@ extern "C" {
     * This function sends a variety of I2C commands to initialize the display
     * The function register is chosen by sending 0xFD, and then choosing a frame
     * Afterwards, the I2C commands will write to that frame until it's changed
+    * Hardware blinking is turned on here, see write_all()
     * For specifics on individual commands, see the code below
     */
     void led_init(void);
@@ -38,12 +39,77 @@ extern "C" {
     void led_write(uint8_t row, uint8_t column, uint8_t brightness);
     
     /*
-    * The LED write_all function begins by initializing the data array to zero
-    * Next, frame 1 is chosen
-    * Afterwards, the all the LED's in every row are turned on.
-    * Finally, the brightness of every led is changed according to the gravity vector
+    * The LED write_all function sends the display whatever changed since the last call
+    * It draws into frames 1 and 2 in turn: the one that isn't displayed gets every change
+    * it hasn't seen yet, then the picture display register flips to it, so an upload never tears
+    * The LED enable block is only sent the first time after led_init(), since every LED stays on
+    * The blink registers are written for the rows whose blink bits changed,
+    * the chip does the blinking so they don't need to be sent again.
+    * Finally, only the brightness of the pixels that changed is sent, in one
+    * write per run of changed pixels. If most of the pixels changed the whole frame is sent.
+    * When neither frame is missing anything, nothing is sent at all
+    * The frame is copied when this is called and sent in the background, so the pixels
+    * can change right away. If the last frame is still being sent, this waits for it
     */
     void write_all ();
+    
+    /*
+    * Returns true once the last frame from write_all() is on display, so the next
+    * write_all() can start without waiting
+    */
+    uint8_t led_ready(void);
+    
+    /*
+    * Turns sending blink changes on or off, they are on after led_init()
+    * While they are off, pixels keep the blink they had and write_all() only sends
+    * brightness. The changes are sent once blinks are turned back on
+    */
+    void led_send_blinks(uint8_t enabled);
+    
+    /*
+    * Turns drawing particles at their sub-cell position on or off, it is off after led_init()
+    * While it is on, a particle's brightness is split between its cell and the empty cells
+    * it leans toward, by how far it is from the center of its cell. Particles then move
+    * smoothly between cells, even when the display isn't updated very often
+    */
+    void led_set_antialias(uint8_t enabled);
+    
+    /*
+    * Frames 3-8 hold an animation the chip can play by itself while nothing moves,
+    * so the PIC and the I2C bus have nothing to do
+    */
+    #define ANIMATION_FIRST_FRAME 2
+    #define ANIMATION_FRAMES 6
+    #define BREATH_DELAY 23 //time each breathing frame is shown (in 11 ms steps)
+    
+    /*
+    * Uploads one animation frame, index 0-5
+    * brightness holds ROWS*COLS values in the same order as the pixel grid
+    * It is sent without a copy, so it can't be a local variable or change until it has been sent
+    * Pixels that are blinking now keep blinking in the animation
+    * Returns the I2C ticket of the frame, brightness can be reused once i2c_done() says it is sent
+    */
+    unsigned int led_load_frame(uint8_t index, uint8_t brightness[]);
+    
+    /*
+    * Uploads a breathing animation of the current picture, it dims and brightens
+    * again over the ANIMATION_FRAMES frames
+    * The frames are made from the pixel data while they are being sent
+    * Waits for each frame to be sent before queueing the next, about 4 ms each
+    */
+    void led_load_breathing(void);
+    
+    /*
+    * Starts the chip playing the first frames animation frames (1-6) in a loop
+    * delay is how long each frame is shown, in 11 ms steps (1-63)
+    * The next write_all() stops the animation
+    */
+    void led_autoplay(uint8_t frames, uint8_t delay);
+    
+    /*
+    * Stops the animation and shows the last frame write_all() drew
+    */
+    void led_stop_autoplay(void);
 
 #ifdef	__cplusplus
 }
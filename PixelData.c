@@ -13,15 +13,17 @@
 #define MAX_BRIGHTNESS 80
 #define MIN_BRIGHTNESS 10
 
-typedef struct {
-        volatile uint8_t brightness;     // brightness of the LED
-        float vx, vy;           // velocity of the LED
-        float rx, ry;           // raw relative position
-        uint8_t data;
-    } LED;
+#define VELOCITY_SCALE ((float) (1 << VELOCITY_Q))
+#define POSITION_SCALE ((float) (1 << POSITION_Q))
 
-LED leds[ROWS][COLS]; //array for 144 LED pixels
-                 //2D array struct [rows][columns] -> [y position][x position]
+PixelGrid grid; //grid of 144 LED pixels, one plane per field
+               //index with CELL(x, y) -> y * COLS + x
+
+// Bit y is set when the blink bits of row y changed since the display last got them
+uint16_t blinkChanges = 0;
+
+// Moved rows whose movedEpoch isn't this one are stale and read as clear
+uint8_t frameEpoch = 1;
 
 void setBlink(uint8_t x, uint8_t y, uint8_t blink);
 uint8_t isBlink(uint8_t x, uint8_t y);
@@ -30,16 +32,21 @@ void setBrightness(uint8_t x, uint8_t y, uint8_t brightness);
 void init_pixels(uint8_t numLit){
     
     //clear all LED pixels' properties
+    for (int cell = 0; cell < ROWS * COLS; cell++) {
+        grid.rx[cell] = 0; //clearing relative x position to its original x position
+        grid.ry[cell] = 0; //clearing relative y position to its original y position
+        grid.vx[cell] = 0; //clearing x velocity
+        grid.vy[cell] = 0; //clearing y velocity
+        grid.frame[1 + cell] = 0; //clearing brightness
+    }
+    grid.frame[0] = FRAME_REGISTER; // the frame is sent starting at the first pixel's register
     for (int row = 0; row < ROWS; row++) {
-        for (int col = 0; col < COLS; col++) {
-            leds[row][col].rx = 0.0f; //clearing relative x position to its original x position
-            leds[row][col].ry = 0.0f; //clearing relative y position to its original y position
-            leds[row][col].vx = 0; //clearing x velocity
-            leds[row][col].vy = 0; //clearing y velocity
-            leds[row][col].brightness = 0; //clearing brightness
-            leds[row][col].data = 0;
-        }
+        grid.blink[row] = 0;
+        grid.moved[row] = 0;
+        grid.movedEpoch[row] = 0;
+        grid.dirty[row] = 0xFFFF >> (16 - COLS); // the display hasn't been sent anything yet
     }
+    blinkChanges = (1u << ROWS) - 1; // the display doesn't know any of the blink bits yet
     
     int litLED = 0;                  //counter for how many LEDs we've lit
     int center = (int) COLS / 2;        //center column of the grid
@@ -62,141 +69,260 @@ void init_pixels(uint8_t numLit){
             }
         }
     }
+}
+
+uint8_t getBrightness(uint8_t x, uint8_t y){
+        
+    return grid.frame[1 + CELL(x, y)];
+}
     
-    T2CON = 0;    
-    PR2 = 65535;  
-    TMR2 = 0;
-    T2CONbits.TCKPS = 0b00;
-
-    T2CONbits.TON = 1;
-
-    IFS0bits.T2IF = 0;
-    IPC1bits.T2IP = 2;
-    IEC0bits.T2IE = 1;
-}
-
-// update brightness for LEDS that blink
-void __attribute__((__interrupt__,__auto_psv__)) _T2Interrupt(void)
-{
-    IFS0bits.T2IF = 0;
-    for (uint8_t row = 0; row < ROWS; row++) {
-        for (uint8_t col = 0; col < COLS; col++) {
-            if (leds[row][col].brightness >= MIN_BRIGHTNESS && isBlink(col, row)) {
-                // MSB is direction of fade and rest are the brightness
-                uint8_t blinkCount = leds[row][col].brightness & 0x7F;
-                if (leds[row][col].brightness >> 7 & 0b1) {
-                    // negative direction
-                    if (blinkCount == MIN_BRIGHTNESS) {
-                        // switch direction
-                        leds[row][col].brightness = MIN_BRIGHTNESS;
-                    } else {
-                        leds[row][col].brightness--;
-                    }
-                } else {
-                    // positive direction
-                    if (blinkCount == MAX_BRIGHTNESS) {
-                        // switch direction
-                        leds[row][col].brightness = 0x80 | MAX_BRIGHTNESS;
-                    } else {
-                        leds[row][col].brightness++;
-                    }
-                }
-            }
-        }
+void setBrightness(uint8_t x, uint8_t y, uint8_t brightness){
+
+    if (grid.frame[1 + CELL(x, y)] != brightness) {
+        grid.frame[1 + CELL(x, y)] = brightness;
+        grid.dirty[y] |= 1u << x;
     }
     
+}
+
+#if FIXED_POINT_PHYSICS
+
+/* Convert a float to fixed point, limited to the range of an int16_t.
+ * 
+ * @param value     The value to convert.
+ * @param scale     1 << the number of fraction bits.
+ */
+int16_t toFixed(float value, float scale){
+    value *= scale;
+    if (value >= INT16_MAX) {
+        return INT16_MAX;
+    } else if (value <= INT16_MIN) {
+        return INT16_MIN;
+    }
+    return value;
+}
+
+float getVelocityX(uint8_t x, uint8_t y){
+        
+    return grid.vx[CELL(x, y)] / VELOCITY_SCALE;
+}
+    
+float getVelocityY(uint8_t x, uint8_t y){
+    
+    return grid.vy[CELL(x, y)] / VELOCITY_SCALE;
+}
+    
+void setVelocity(uint8_t x, uint8_t y, float vx, float vy){
+    
+    grid.vx[CELL(x, y)] = toFixed(vx, VELOCITY_SCALE);
+    grid.vy[CELL(x, y)] = toFixed(vy, VELOCITY_SCALE);
     
 }
 
-uint8_t getBrightness(uint8_t x, uint8_t y){
+float getRawRelativePositionX(uint8_t x, uint8_t y){
+    
+    return grid.rx[CELL(x, y)] / POSITION_SCALE;
+}
+
+float getRawRelativePositionY(uint8_t x, uint8_t y){
         
-    return leds[y][x].brightness;
+    return grid.ry[CELL(x, y)] / POSITION_SCALE;
 }
+
+void setRawRelativePosition(uint8_t x, uint8_t y, float rx, float ry){
     
-void setBrightness(uint8_t x, uint8_t y, uint8_t brightness){
+    grid.rx[CELL(x, y)] = toFixed(rx, POSITION_SCALE);
+    grid.ry[CELL(x, y)] = toFixed(ry, POSITION_SCALE);
+    
+}
 
-    leds[y][x].brightness = brightness;
+int16_t getVelocityXFixed(uint8_t x, uint8_t y){
+        
+    return grid.vx[CELL(x, y)];
+}
+    
+int16_t getVelocityYFixed(uint8_t x, uint8_t y){
+    
+    return grid.vy[CELL(x, y)];
+}
+    
+void setVelocityFixed(uint8_t x, uint8_t y, int16_t vx, int16_t vy){
+    
+    grid.vx[CELL(x, y)] = vx;
+    grid.vy[CELL(x, y)] = vy;
     
 }
 
+int16_t getRawRelativePositionXFixed(uint8_t x, uint8_t y){
+    
+    return grid.rx[CELL(x, y)];
+}
+
+int16_t getRawRelativePositionYFixed(uint8_t x, uint8_t y){
+        
+    return grid.ry[CELL(x, y)];
+}
+
+void setRawRelativePositionFixed(uint8_t x, uint8_t y, int16_t rx, int16_t ry){
+    
+    grid.rx[CELL(x, y)] = rx;
+    grid.ry[CELL(x, y)] = ry;
+    
+}
+
+#else
+
 float getVelocityX(uint8_t x, uint8_t y){
         
-    return leds[y][x].vx;
+    return grid.vx[CELL(x, y)];
 }
     
 float getVelocityY(uint8_t x, uint8_t y){
     
-    return leds[y][x].vy;
+    return grid.vy[CELL(x, y)];
 }
     
 void setVelocity(uint8_t x, uint8_t y, float vx, float vy){
     
-    leds[y][x].vx = vx;
-    leds[y][x].vy = vy;
+    grid.vx[CELL(x, y)] = vx;
+    grid.vy[CELL(x, y)] = vy;
     
 }
 
 float getRawRelativePositionX(uint8_t x, uint8_t y){
     
-    return leds[y][x].rx;
+    return grid.rx[CELL(x, y)];
 }
 
 float getRawRelativePositionY(uint8_t x, uint8_t y){
         
-    return leds[y][x].ry;
+    return grid.ry[CELL(x, y)];
 }
 
 void setRawRelativePosition(uint8_t x, uint8_t y, float rx, float ry){
     
-    leds[y][x].rx = rx;
-    leds[y][x].ry = ry;
+    grid.rx[CELL(x, y)] = rx;
+    grid.ry[CELL(x, y)] = ry;
+    
+}
+
+int16_t getVelocityXFixed(uint8_t x, uint8_t y){
+        
+    return grid.vx[CELL(x, y)] * VELOCITY_SCALE;
+}
+    
+int16_t getVelocityYFixed(uint8_t x, uint8_t y){
+    
+    return grid.vy[CELL(x, y)] * VELOCITY_SCALE;
+}
+    
+void setVelocityFixed(uint8_t x, uint8_t y, int16_t vx, int16_t vy){
+    
+    grid.vx[CELL(x, y)] = vx / VELOCITY_SCALE;
+    grid.vy[CELL(x, y)] = vy / VELOCITY_SCALE;
+    
+}
+
+int16_t getRawRelativePositionXFixed(uint8_t x, uint8_t y){
+    
+    return grid.rx[CELL(x, y)] * POSITION_SCALE;
+}
+
+int16_t getRawRelativePositionYFixed(uint8_t x, uint8_t y){
+        
+    return grid.ry[CELL(x, y)] * POSITION_SCALE;
+}
+
+void setRawRelativePositionFixed(uint8_t x, uint8_t y, int16_t rx, int16_t ry){
+    
+    grid.rx[CELL(x, y)] = rx / POSITION_SCALE;
+    grid.ry[CELL(x, y)] = ry / POSITION_SCALE;
     
 }
 
+#endif
+
+PixelGrid* getPixelGrid() {
+    return &grid;
+}
+
 uint8_t isMoved(uint8_t x, uint8_t y) {
-    return leds[y][x].data & 0b1;
+    if (grid.movedEpoch[y] != frameEpoch) {
+        return 0;
+    }
+    return grid.moved[y] >> x & 0b1;
 }
 
 void setMoved(uint8_t x, uint8_t y, uint8_t moved) {
+    if (grid.movedEpoch[y] != frameEpoch) {
+        grid.moved[y] = 0; // left over from an earlier frame
+        grid.movedEpoch[y] = frameEpoch;
+    }
     if (moved) {
-        leds[y][x].data |= 0x01;
+        grid.moved[y] |= 1u << x;
     } else {
-        leds[y][x].data &= 0xFE;
+        grid.moved[y] &= ~(1u << x);
     }
 }
 
 void clearMoved() {
-    for (int row = 0; row < ROWS; row++) {
-        for (int col = 0; col < COLS; col++) {
-            setMoved(col, row, 0);
+    frameEpoch++;
+    if (frameEpoch == 0) {
+        // wrapped around, so old epochs could match again
+        for (int row = 0; row < ROWS; row++) {
+            grid.movedEpoch[row] = 0;
         }
+        frameEpoch = 1;
     }
 }
 
 uint8_t isBlink(uint8_t x, uint8_t y) {
-    return leds[y][x].data >> 1 & 0b1;
+    return grid.blink[y] >> x & 0b1;
 }
 
 void setBlink(uint8_t x, uint8_t y, uint8_t blink) {
+    uint16_t row = grid.blink[y];
     if (blink) {
-        leds[y][x].data |= 0x02;
+        row |= 1u << x;
     } else {
-        leds[y][x].data &= 0xFD;
+        row &= ~(1u << x);
+    }
+    if (row != grid.blink[y]) {
+        grid.blink[y] = row;
+        blinkChanges |= 1u << y;
     }
 }
 
+uint16_t getBlinkRow(uint8_t y) {
+    return grid.blink[y];
+}
+
+uint16_t takeBlinkChanges() {
+    uint16_t changes = blinkChanges;
+    blinkChanges = 0;
+    return changes;
+}
+
+uint16_t takeDirtyRow(uint8_t y) {
+    uint16_t dirty = grid.dirty[y];
+    grid.dirty[y] = 0;
+    return dirty;
+}
+
 uint8_t getDisplayBrightness(uint8_t x, uint8_t y) {
-    if (isBlink(x, y)) {
-        return getBrightness(x, y) & 0x7F;
-    } else {
-        return getBrightness(x, y);
-    }
+    // blinking is done by the display, so this is just the brightness
+    return getBrightness(x, y);
+}
+
+uint8_t* getFrame() {
+    return grid.frame;
 }
 
 uint8_t getData(uint8_t x, uint8_t y) {
-    return leds[y][x].data;
+    // the attributes are stored as bit planes, put them back together
+    return isBlink(x, y) << 1;
 }
 
 void setData(uint8_t x, uint8_t y, uint8_t data) {
-    leds[y][x].data = data;
+    setBlink(x, y, data >> 1 & 0b1);
 }
\ No newline at end of file
@@ -14,6 +14,42 @@ extern "C" {
     
     #define ROWS 9
     #define COLS 16
+    
+    // 1 to store velocity and raw relative position as fixed point and run the
+    // integer physics engine, 0 to store them as floats and use the float engine.
+    #ifndef FIXED_POINT_PHYSICS
+    #define FIXED_POINT_PHYSICS 1
+    #endif
+    #define VELOCITY_Q 10   // fixed point velocity is Q6.10 (cells per second)
+    #define POSITION_Q 12   // fixed point raw relative position is Q4.12 (cells)
+
+    #define CELL(x, y) ((y) * COLS + (x)) // index of a pixel in the planes of a PixelGrid
+    #define FRAME_REGISTER 0x24 // display register of the first pixel, sent ahead of the frame
+    #define FRAME_SIZE (1 + ROWS * COLS) // FRAME_REGISTER followed by every pixel's brightness
+
+    // Storage for every pixel. Each field has its own plane indexed by 
+    // CELL(x, y), so a sweep over one field reads memory in order. 
+    // Flags take one bit per pixel, bit x of a row word.
+    // The brightness plane is laid out like a write to the display: the first
+    // register followed by one brightness per LED, so cell c is at frame[1 + c].
+    typedef struct {
+        uint8_t frame[FRAME_SIZE];  // brightness of the LED, after FRAME_REGISTER
+#if FIXED_POINT_PHYSICS
+        int16_t vx[ROWS * COLS];    // velocity of the LED (VELOCITY_Q)
+        int16_t vy[ROWS * COLS];
+        int16_t rx[ROWS * COLS];    // raw relative position (POSITION_Q)
+        int16_t ry[ROWS * COLS];
+#else
+        float vx[ROWS * COLS];      // velocity of the LED
+        float vy[ROWS * COLS];
+        float rx[ROWS * COLS];      // raw relative position
+        float ry[ROWS * COLS];
+#endif
+        uint16_t blink[ROWS];       // blink attribute
+        uint16_t moved[ROWS];       // moved in the row's epoch
+        uint8_t movedEpoch[ROWS];   // frame epoch the moved row belongs to
+        uint16_t dirty[ROWS];       // brightness changed since the display got it
+    } PixelGrid;
 
     /* Initialize the pixel data with some pixels lit.
      * 
@@ -82,6 +118,62 @@ extern "C" {
      */
     void setRawRelativePosition(uint8_t x, uint8_t y, float rx, float ry);
     
+    /* Get the X component of the velocity of a pixel in fixed point (VELOCITY_Q).
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     */
+    int16_t getVelocityXFixed(uint8_t x, uint8_t y);
+    
+    /* Get the Y component of the velocity of a pixel in fixed point (VELOCITY_Q).
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     */
+    int16_t getVelocityYFixed(uint8_t x, uint8_t y);
+    
+    /* Set the velocity of the pixel in fixed point (VELOCITY_Q).
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     * @param vx    The x component of the velocity.
+     * @param vy    The y component of the velocity.
+     */
+    void setVelocityFixed(uint8_t x, uint8_t y, int16_t vx, int16_t vy);
+    
+    /* Get the X component of the raw relative position of a pixel in fixed
+     * point (POSITION_Q).
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     */
+    int16_t getRawRelativePositionXFixed(uint8_t x, uint8_t y);
+    
+    /* Get the Y component of the raw relative position of a pixel in fixed
+     * point (POSITION_Q).
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     */
+    int16_t getRawRelativePositionYFixed(uint8_t x, uint8_t y);
+    
+    /* Set the raw relative position of a pixel in fixed point (POSITION_Q).
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     * @param rx    The x component of the relative position of the pixel.
+     * @param ry    The y component of the relative position of the pixel
+     */
+    void setRawRelativePositionFixed(uint8_t x, uint8_t y, int16_t rx, int16_t ry);
+    
+    /* Get the storage behind the pixel data. This lets code that visits a lot
+     * of pixels, like the physics step, read and write them directly instead of
+     * going through a getter for every field.
+     * 
+     * @returns     The pixel grid.
+     */
+    PixelGrid* getPixelGrid();
+    
     /* Check if a certain pixel has the moved attribute.
      * 
      * @param x     The x position of the pixel.
@@ -98,11 +190,14 @@ extern "C" {
      */
     void setMoved(uint8_t x, uint8_t y, uint8_t moved);
     
-    /* Clear the moved attribute on all pixels.
+    /* Clear the moved attribute on all pixels. This just starts a new frame
+     * epoch, so it doesn't have to visit every row; a row's moved bits are
+     * reset the first time one of them is set in the new epoch.
      */
     void clearMoved();
     
-    /* Get the data for a pixel. This holds the pixel attributes.
+    /* Get the data for a pixel. This holds the pixel attributes, bit 1 is the
+     * blink attribute.
      * 
      * @param x     The x position of the pixel.
      * @param y     The y position of the pixel.
@@ -118,14 +213,45 @@ extern "C" {
      */
     void setData(uint8_t x, uint8_t y, uint8_t data);
     
+    /* Get the blink attributes of a row, bit x is the pixel at (x, y).
+     * 
+     * @param y     The row.
+     * @returns     The blink bits of the row.
+     */
+    uint16_t getBlinkRow(uint8_t y);
+    
+    /* Get which rows had their blink attributes change since the last call.
+     * The display only needs its blink registers written for these rows.
+     * 
+     * @returns     Bit y is set if row y changed.
+     */
+    uint16_t takeBlinkChanges();
+    
+    /* Get which pixels of a row changed brightness since the last call for
+     * that row. The display only needs these pixels sent again.
+     * 
+     * @param y     The row.
+     * @returns     Bit x is set if the pixel at (x, y) changed.
+     */
+    uint16_t takeDirtyRow(uint8_t y);
+    
     /* Get the brightness that should be displayed for this pixel.
-     * The regular brightness may be modified according to the pixel attributes.
+     * Blinking pixels are animated by the display, so this is the brightness
+     * they have when they are on.
      * 
      * @param x     The x position of the pixel.
      * @param y     The y position of the pixel.
      * @returns     The brightness of the pixel ready to be displayed.
      */
     uint8_t getDisplayBrightness(uint8_t x, uint8_t y);
+    
+    /* Get the brightness plane as it is written to the display: FRAME_REGISTER
+    * followed by the brightness of every pixel in CELL() order. It can be sent
+    * as is, FRAME_SIZE bytes. Blinking is done by the display, so it needs no changes.
+    * 
+    * @returns     The FRAME_SIZE byte frame.
+    */
+    uint8_t* getFrame();
 
 
 #ifdef	__cplusplus
@@ -8,11 +8,153 @@
 
 #include "xc.h"
 #include "PixelData.h"
+#include "PositionCalculator.h"
+#include <math.h> // for fabsf
 
 #define LED_ON 10
 #define LED_OFF 0
-#define WATER_EFFECT 1
+#define WATER_EFFECT 1 // start as MATERIAL_WATER instead of MATERIAL_SAND
 
+#define MAX_PARTICLES (ROWS * COLS)
+#define MAX_FIXED_DT 500 // longest step the fixed point engine can take without overflowing
+#define NEIGHBOUR(dx, dy) (4 + (dx) + 3 * (dy)) // bit of (x + dx, y + dy) in a neighbour mask
+#define MOVE_COUNT 5 // number of moves tryMove() can pick from
+#define NO_MOVE 0xFF
+#define SLEEP_ACCEL 1.0f // acceleration below this doesn't push a sleeping particle
+#define WAKE_ACCEL 1.0f  // change in acceleration that wakes every particle
+#define AXIS_DOMINANCE 2.0f // an axis dominates when its acceleration is this many times the other
+#define SLEEP_SPEED 0.5f // particles slower than this can fall asleep (cells per second)
+#define MAX_PHYSICS_STEPS 8 // most steps advancePhysics() will run to catch up
+#define MAX_LINES (COLS > ROWS ? COLS : ROWS) // most lines findLines() can split the grid into
+
+// How findLines() split the grid
+#define LINES_NONE 0    // neither axis dominates, every particle is stepped on its own
+#define LINES_COLUMNS 1 // the acceleration pushes along y
+#define LINES_ROWS 2    // the acceleration pushes along x
+
+#if FIXED_POINT_PHYSICS
+#define VELOCITY_X(x, y) getVelocityXFixed(x, y)
+#define VELOCITY_Y(x, y) getVelocityYFixed(x, y)
+#else
+#define VELOCITY_X(x, y) getVelocityX(x, y)
+#define VELOCITY_Y(x, y) getVelocityY(x, y)
+#endif
+
+// Values that are the same for every particle in a fixed point step
+typedef struct {
+    uint16_t dt;        // length of the step in seconds (Q16)
+    int16_t dvx, dvy;   // velocity added by the acceleration (VELOCITY_Q)
+    int16_t hx, hy;     // 1/2 * a * dt^2 (POSITION_Q)
+} FixedStep;
+
+// Values that are the same for every particle in a float step
+typedef struct {
+    float dt;           // length of the step in seconds
+    float dvx, dvy;     // velocity added by the acceleration
+    float hx, hy;       // 1/2 * a * dt^2
+} FloatStep;
+
+// Occupancy bitmap, bit x of occupancy[y] is set when there is a pixel at (x, y).
+// This is kept up to date by movePixel() so collision checks don't depend on brightness.
+uint16_t occupancy[ROWS];
+
+// Column bitmap, bit y of columns[x] is set when there is a pixel at (x, y).
+// The same cells as occupancy, turned sideways so a column can be read at once.
+uint16_t columns[COLS];
+
+// Cells that hold a particle. Only these are simulated, so the cost of a step
+// depends on the number of particles and not the size of the grid.
+// The rest of a particle's state moves with it in PixelData.
+uint8_t particles[MAX_PARTICLES];
+uint8_t numParticles = 0;
+
+// Moves tryMove() can pick from when a pixel is blocked, in the order they are
+// tried. Bit n of a move mask is move n:
+//  0: (dx, 0)      straight along x
+//  1: (0, dy)      straight along y
+//  2: (dx, vy)     along x, sliding the way it is moving in y
+//  3: (vx, dy)     along y, sliding the way it is moving in x
+//  4: (dx, dy)     only the cell it is heading for
+// Each material allows a set of these moves.
+const uint8_t materialMoves[] = {
+    0b00011, // MATERIAL_SAND
+    0b01111, // MATERIAL_WATER
+    0b10000, // MATERIAL_RIGID
+};
+
+// Lowest set bit in a 5 bit move mask, the move that gets picked
+const uint8_t firstMove[1 << MOVE_COUNT] = {
+    NO_MOVE, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+    4,       0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+};
+
+// Offset of each cell in a 3x3 neighbour mask
+const int8_t neighbourX[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
+const int8_t neighbourY[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+
+uint8_t material = WATER_EFFECT ? MATERIAL_WATER : MATERIAL_SAND;
+uint8_t engine = PHYSICS_NEWTONIAN;
+
+// The eight neighbours in order around the pixel, starting at (1, 0)
+const int8_t ringX[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+const int8_t ringY[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+// Position of each cell of a 3x3 neighbour mask in the ring (the center isn't in it)
+const uint8_t ringIndex[9] = {5, 6, 7, 4, 0, 0, 3, 2, 1};
+// How far around the ring from straight down each material can move in the automaton
+const uint8_t materialSpread[] = {
+    1, // MATERIAL_SAND, straight down or diagonally down
+    2, // MATERIAL_WATER, also sideways
+    0, // MATERIAL_RIGID, only straight down
+};
+
+uint16_t randomState = 0xACE1; // state of random(), never 0
+uint8_t scanFlip = 0; // flips every automaton step to alternate the scan direction
+
+// Sleep bitmap, bit x of asleep[y] is set when the particle at (x, y) is asleep.
+// Sleeping particles are skipped until a neighbour moves or the acceleration changes.
+uint16_t asleep[ROWS];
+uint8_t gridAsleep = 0;     // every particle is asleep
+float restAx = 0, restAy = 0; // acceleration the sleeping particles settled under
+int8_t restPushX = 0, restPushY = 0; // direction that acceleration pushes in
+
+// Time that has passed but has not been simulated yet (in 100 us ticks)
+unsigned long physicsTime = 0;
+unsigned int stepLength = PHYSICS_STEP; // length of the steps advancePhysics() runs (in 100 us ticks)
+
+    /* Build the occupancy bitmap and particle list from the brightness of each pixel.
+     */
+    void init_particles() {
+        numParticles = 0;
+        gridAsleep = 0;
+        for (uint8_t col = 0; col < COLS; col++) {
+            columns[col] = 0;
+        }
+        for (uint8_t row = 0; row < ROWS; row++) {
+            occupancy[row] = 0;
+            asleep[row] = 0;
+            for (uint8_t col = 0; col < COLS; col++) {
+                if (getBrightness(col, row) >= LED_ON) {
+                    occupancy[row] |= 1u << col;
+                    columns[col] |= 1u << row;
+                    particles[numParticles++] = CELL(col, row);
+                }
+            }
+        }
+    }
+    
+    /* Update the particle list after a particle was moved outside of stepParticles().
+     * 
+     * @param from  The cell the particle was in.
+     * @param to    The cell the particle is in now.
+     */
+    void replaceParticle(uint8_t from, uint8_t to) {
+        for (uint8_t i = 0; i < numParticles; i++) {
+            if (particles[i] == from) {
+                particles[i] = to;
+                return;
+            }
+        }
+    }
     
     /* Check if a position is open relative to another. AKA checking if the
      * pixel at (x + dx, y + dy) is lit already.
@@ -27,12 +169,68 @@
             // index out of bounds
             return 0;
         }
-        if (getBrightness(x + dx, y + dy) >= LED_ON){
-            // check if LED is one to see if the space is open
-            return 0;
-        } else {
-            return 1;
+        // check the occupancy bit to see if the space is open
+        return !(occupancy[y + dy] >> (x + dx) & 0b1);
+    }
+    
+    /* Get three bits of a row of the occupancy bitmap, centered on a column.
+     * Positions outside of the grid count as occupied.
+     * 
+     * @param x     The center column.
+     * @param y     The row, may be one past either edge.
+     * @returns     Bit 0 is x - 1, bit 1 is x and bit 2 is x + 1.
+     */
+    uint8_t rowBits(uint8_t x, int8_t y){
+        if (y < 0 || y >= ROWS) {
+            return 0b111;
         }
+        // add a wall bit on each side so x - 1 and x + 1 are always in range
+        uint32_t row = ((uint32_t) occupancy[y] << 1) | 0b1 | (1ul << (COLS + 1));
+        return row >> x & 0b111;
+    }
+    
+    /* Get the occupancy of the 3x3 block around a pixel, with positions
+     * outside of the grid counted as occupied.
+     * 
+     * @param x     The x position of the center pixel.
+     * @param y     The y position of the center pixel.
+     * @returns     Bit NEIGHBOUR(dx, dy) is set when (x + dx, y + dy) is occupied.
+     */
+    uint16_t neighbours(uint8_t x, uint8_t y){
+        return rowBits(x, y - 1) | rowBits(x, y) << 3 | (uint16_t) rowBits(x, y + 1) << 6;
+    }
+    
+    /* Set how blocked pixels move.
+     * 
+     * @param newMaterial   MATERIAL_SAND, MATERIAL_WATER or MATERIAL_RIGID.
+     */
+    void setMaterial(uint8_t newMaterial){
+        material = newMaterial;
+    }
+    
+    /* Wake the particles around a cell.
+     * 
+     * @param x     The x position of the cell.
+     * @param y     The y position of the cell.
+     */
+    void wakeAround(uint8_t x, uint8_t y){
+        // bits x - 1 to x + 1, cut off at the edges of the row
+        uint16_t bits = ((uint32_t) 0b111 << x) >> 1;
+        for (int8_t row = y - 1; row <= y + 1; row++) {
+            if (row >= 0 && row < ROWS) {
+                asleep[row] &= ~bits;
+            }
+        }
+        gridAsleep = 0;
+    }
+    
+    /* Wake every particle.
+     */
+    void wakeAll(){
+        for (uint8_t row = 0; row < ROWS; row++) {
+            asleep[row] = 0;
+        }
+        gridAsleep = 0;
     }
     
     /* Move a pixel to another position. The pixel at the (xTo, yTo) position
@@ -44,7 +242,28 @@
      * @param xTo       The new x position of the pixel.
      * @param yTo       The new y position of the pixel.
      */
-    void movePixel(uint8_t xFrom, uint8_t yFrom, uint8_t xTo, uint8_t yTo){
+    void moveCell(uint8_t xFrom, uint8_t yFrom, uint8_t xTo, uint8_t yTo){
+#if FIXED_POINT_PHYSICS
+        int16_t OrignalVelX = getVelocityXFixed(xFrom, yFrom);
+        int16_t OrignalVelY = getVelocityYFixed(xFrom, yFrom);
+        int16_t OrignalX = getRawRelativePositionXFixed(xFrom, yFrom);
+        int16_t OrignalY = getRawRelativePositionYFixed(xFrom, yFrom);
+        uint8_t OrignalBright = getBrightness(xFrom, yFrom);
+        // get original values
+        
+        setRawRelativePositionFixed(xTo, yTo, OrignalX - ((xTo - xFrom) << POSITION_Q), OrignalY - ((yTo - yFrom) << POSITION_Q));
+        setData(xTo, yTo, getData(xFrom, yFrom));
+        setMoved(xTo, yTo, 1);
+        setVelocityFixed(xTo, yTo, OrignalVelX, OrignalVelY);
+        setBrightness(xTo, yTo, OrignalBright);
+        // set new postion to orginial value
+       
+        setData(xFrom, yFrom, 0);
+        setRawRelativePositionFixed(xFrom, yFrom, 0, 0);
+        setVelocityFixed(xFrom, yFrom, 0, 0);
+        setBrightness(xFrom, yFrom, LED_OFF);
+        //reset orginial position 
+#else
         float OrignalVelX = getVelocityX(xFrom, yFrom);
         float OrignalVelY = getVelocityY(xFrom, yFrom);
         float OrignalX = getRawRelativePositionX(xFrom, yFrom);
@@ -65,57 +284,275 @@
         setBrightness(xFrom, yFrom, LED_OFF);
         //reset orginial position 
         
+#endif
+        
+        occupancy[yFrom] &= ~(1u << xFrom);
+        occupancy[yTo] |= 1u << xTo;
+        columns[xFrom] &= ~(1u << yFrom);
+        columns[xTo] |= 1u << yTo;
+        
+        // the pixel is moving and its old neighbours may have room now
+        asleep[yFrom] &= ~(1u << xFrom);
+        asleep[yTo] &= ~(1u << xTo);
+        wakeAround(xFrom, yFrom);
+        
+    }
+    
+    /* Move a pixel and update the particle list, see moveCell().
+     */
+    void movePixel(uint8_t xFrom, uint8_t yFrom, uint8_t xTo, uint8_t yTo){
+        moveCell(xFrom, yFrom, xTo, yTo);
+        replaceParticle(CELL(xFrom, yFrom), CELL(xTo, yTo));
+    }
+    
+    /* Find which of the moves in materialMoves are open for a pixel.
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     * @param dx    The change in x position. (Should be -1, 0, or 1)
+     * @param dy    The change in y position. (Should be -1, 0, or 1)
+     * @param vx    The way to slide in x when moving along y. (Should be -1, 0, or 1)
+     * @param vy    The way to slide in y when moving along x. (Should be -1, 0, or 1)
+     * @param moves Filled in with the neighbour bit of each move.
+     * @returns     The open moves the current material allows, bit n is move n.
+     */
+    uint8_t openMoves(uint8_t x, uint8_t y, int8_t dx, int8_t dy, int8_t vx, int8_t vy, uint8_t* moves){
+        // only slide sideways when moving along that axis
+        if (dx == 0) {
+            vy = 0;
+        }
+        if (dy == 0) {
+            vx = 0;
+        }
+        // moves that don't apply point at the pixel itself, which is never open
+        moves[0] = NEIGHBOUR(dx, 0);
+        moves[1] = NEIGHBOUR(0, dy);
+        moves[2] = NEIGHBOUR(dx, vy);
+        moves[3] = NEIGHBOUR(vx, dy);
+        moves[4] = NEIGHBOUR(dx, dy);
+        uint16_t open = ~neighbours(x, y);
+        uint8_t mask = 0;
+        for (uint8_t i = 0; i < MOVE_COUNT; i++) {
+            mask |= (open >> moves[i] & 0b1) << i;
+        }
+        return mask & materialMoves[material];
     }
     
     /* Try to move a pixel in a direction. If there is already a pixel in the
      * direction to move to, the pixels on either side of that pixel will be 
      * checked. If none of those positions are empty, the pixel will not be moved.
+     * Which positions are checked depends on the material, see materialMoves.
      * 
      * @param x     The x position of the pixel to be moved.
      * @param y     The y position of the pixel to be moved.
      * @param dx    The change in x position. (Should be -1, 0, or 1)
      * @param dy    The change in y position. (Should be -1, 0, or 1)   
+     * @returns     The cell the pixel ended up in.
      */
-    void tryMovePixel(uint8_t x, uint8_t y, int8_t dx, int8_t dy){
+    uint8_t tryMove(uint8_t x, uint8_t y, int8_t dx, int8_t dy){
         if ((x == 0 && dx < 0) || (x == COLS - 1 && dx > 0)) {
             dx = 0;
             // cannot move, reset raw pos and velocity
+#if FIXED_POINT_PHYSICS
+            setRawRelativePositionFixed(x, y, 0, getRawRelativePositionYFixed(x, y));
+            setVelocityFixed(x, y, 0, getVelocityYFixed(x, y));
+#else
             setRawRelativePosition(x, y, 0, getRawRelativePositionY(x, y));
             setVelocity(x, y, 0.0, getVelocityY(x, y));
+#endif
         }
         
         if ((y == 0 && dy < 0) || (y == ROWS - 1 && dy > 0)) {
             dy = 0;
             // cannot move, reset raw pos and velocity
+#if FIXED_POINT_PHYSICS
+            setRawRelativePositionFixed(x, y, getRawRelativePositionXFixed(x, y), 0);
+            setVelocityFixed(x, y, getVelocityXFixed(x, y), 0);
+#else
             setRawRelativePosition(x, y, getRawRelativePositionX(x, y), 0);
             setVelocity(x, y, getVelocityX(x, y), 0.0);
+#endif
         }
         
-        if (isOpen(x, y, 0, 0) == 0 && (dx != 0 || dy != 0)) {
-            // pixel present
-            if (isOpen(x, y, dx, 0)) {
-                movePixel(x, y, x + dx, y);
-            } else if (isOpen(x, y, 0, dy)) {
-                movePixel(x, y, x, y + dy);
-            } else if (WATER_EFFECT && dx != 0 && isOpen(x, y, dx, 1) && getVelocityY(x, y) > 0) {
-                movePixel(x, y, x + dx, y + 1);
-            } else if (WATER_EFFECT && dx != 0 && isOpen(x, y, dx, -1) && getVelocityY(x, y) < 0) {
-                movePixel(x, y, x + dx, y - 1);
-            } else if (WATER_EFFECT && dy != 0 && isOpen(x, y, 1, dy) && getVelocityX(x, y) > 0) {
-                movePixel(x, y, x + 1, y + dy);
-            } else if (WATER_EFFECT && dy != 0 && isOpen(x, y, -1, dy) && getVelocityX(x, y) < 0) {
-                movePixel(x, y, x - 1, y + dy);
-            } else {
-                // cannot move, reset velocity
-                setVelocity(x, y, 0.0, 0.0);
-                setRawRelativePosition(x, y, 0, 0);
+        if (dx == 0 && dy == 0) {
+            return CELL(x, y);
+        }
+        
+        if (!(occupancy[y] >> x & 0b1)) {
+            // there is no pixel here to move
+            return CELL(x, y);
+        }
+        
+        int8_t vx = (VELOCITY_X(x, y) > 0) - (VELOCITY_X(x, y) < 0);
+        int8_t vy = (VELOCITY_Y(x, y) > 0) - (VELOCITY_Y(x, y) < 0);
+        uint8_t moves[MOVE_COUNT];
+        uint8_t mask = openMoves(x, y, dx, dy, vx, vy, moves);
+        
+        uint8_t move = firstMove[mask];
+        if (move == NO_MOVE) {
+            // cannot move, reset raw pos and velocity along the axes that were tried.
+            // An axis that hasn't built up half a cell yet keeps going.
+            PixelGrid* grid = getPixelGrid();
+            uint8_t cell = CELL(x, y);
+            if (dx != 0) {
+                grid->vx[cell] = 0;
+                grid->rx[cell] = 0;
             }
-            
+            if (dy != 0) {
+                grid->vy[cell] = 0;
+                grid->ry[cell] = 0;
+            }
+            return CELL(x, y);
         }
+        int8_t mx = neighbourX[moves[move]];
+        int8_t my = neighbourY[moves[move]];
+        moveCell(x, y, x + mx, y + my);
+        return CELL(x + mx, y + my);
     }
     
+    /* Try to move a pixel and update the particle list, see tryMove().
+     */
+    void tryMovePixel(uint8_t x, uint8_t y, int8_t dx, int8_t dy){
+        uint8_t to = tryMove(x, y, dx, dy);
+        if (to != CELL(x, y)) {
+            replaceParticle(CELL(x, y), to);
+        }
+    }
     
     
+    
+    /* Limit a value to the range of an int16_t.
+     * 
+     * @param value     The value to limit.
+     */
+    int16_t saturate16(long value){
+        if (value > INT16_MAX) {
+            return INT16_MAX;
+        } else if (value < INT16_MIN) {
+            return INT16_MIN;
+        }
+        return value;
+    }
+    
+#if FIXED_POINT_PHYSICS
+    
+    /* Work out the fixed point values that are shared by every particle in a step.
+     * 
+     * @param step  The step values to fill in.
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The change in time since the last acceleration.
+     */
+    void makeFixedStep(FixedStep* step, float ax, float ay, unsigned long dt){
+        if (dt > MAX_FIXED_DT) {
+            dt = MAX_FIXED_DT;
+        }
+        step->dt = (dt << 16) / 1000; // convert dt to seconds
+        long fixedAx = saturate16(ax * (1 << VELOCITY_Q));
+        long fixedAy = saturate16(ay * (1 << VELOCITY_Q));
+        step->dvx = (fixedAx * step->dt) >> 16;
+        step->dvy = (fixedAy * step->dt) >> 16;
+        // 1/2 * (a * dt) * dt, shifted from VELOCITY_Q * Q16 to POSITION_Q
+        step->hx = ((long) step->dvx * step->dt) >> (17 + VELOCITY_Q - POSITION_Q);
+        step->hy = ((long) step->dvy * step->dt) >> (17 + VELOCITY_Q - POSITION_Q);
+    }
+    
+    /* rounds a fixed point raw relative position to -1, 0, or 1.
+     * 
+     * @param d    The raw relative position (POSITION_Q). 
+     */
+    int8_t signfixed(int16_t d){
+        if (d < -(1 << (POSITION_Q - 1))){
+            return -1;
+        } else if (d > (1 << (POSITION_Q - 1))){
+            return 1;
+        }
+        return 0;
+    }
+    
+    /* Update the velocity and raw relative position of a pixel for one step
+     * and possibly move it. The fields are read and written straight from the
+     * planes of the grid, only the move goes through movePixel().
+     * 
+     * dx = vx*dt + (1/2)*ax*dt^2
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     * @param grid  The pixel grid.
+     * @param cell  CELL(x, y).
+     * @param step  The values shared by every particle in this step.
+     * @returns     The cell the pixel ended up in.
+     */
+    uint8_t integrateFixed(uint8_t x, uint8_t y, PixelGrid* grid, uint8_t cell, const FixedStep* step){
+        int16_t OrignalVelX = grid->vx[cell];
+        int16_t OrignalVelY = grid->vy[cell];
+        
+        // dx = vx*dt + (1/2)*ax*dt^2, shifted from VELOCITY_Q * Q16 to POSITION_Q
+        int16_t RawX = saturate16(grid->rx[cell] + (((long) OrignalVelX * step->dt) >> (16 + VELOCITY_Q - POSITION_Q)) + step->hx);
+        int16_t RawY = saturate16(grid->ry[cell] + (((long) OrignalVelY * step->dt) >> (16 + VELOCITY_Q - POSITION_Q)) + step->hy);
+        
+        grid->rx[cell] = RawX;
+        grid->ry[cell] = RawY;
+        grid->vx[cell] = saturate16((long) OrignalVelX + step->dvx);
+        grid->vy[cell] = saturate16((long) OrignalVelY + step->dvy);
+        
+        return tryMove(x, y, signfixed(RawX), signfixed(RawY));
+    }
+    
+    /* Fixed point version of accelerate(). Uses the same equations, but all of
+     * the values that don't depend on the pixel are worked out in makeFixedStep().
+     * 
+     * @param x     The x position of the pixel to apply the acceleration to.
+     * @param y     The y position of the pixel to apply acceleration to.
+     * @param step  The values shared by every particle in this step.
+     * @returns     The cell the pixel ended up in.
+     */
+    uint8_t accelerateFixed(uint8_t x, uint8_t y, const FixedStep* step){
+        if (isMoved(x, y)) {
+            return CELL(x, y);
+        }
+        return integrateFixed(x, y, getPixelGrid(), CELL(x, y), step);
+    }
+    
+    /* Check if a pixel is slow enough to fall asleep. Velocity in a direction
+     * the pixel is pushed doesn't count, the caller has checked that it is
+     * blocked that way.
+     * 
+     * @param grid  The pixel grid.
+     * @param cell  The cell of the pixel.
+     * @param pushX The way the acceleration pushes in x. (Should be -1, 0, or 1)
+     * @param pushY The way the acceleration pushes in y. (Should be -1, 0, or 1)
+     */
+    uint8_t isSlow(const PixelGrid* grid, uint8_t cell, int8_t pushX, int8_t pushY){
+        const int16_t limit = SLEEP_SPEED * (1 << VELOCITY_Q);
+        int16_t vx = grid->vx[cell];
+        int16_t vy = grid->vy[cell];
+        if ((pushX > 0 && vx > 0) || (pushX < 0 && vx < 0)) {
+            vx = 0;
+        }
+        if ((pushY > 0 && vy > 0) || (pushY < 0 && vy < 0)) {
+            vy = 0;
+        }
+        return vx < limit && vx > -limit && vy < limit && vy > -limit;
+    }
+    
+#else
+    
+    /* Work out the values that are shared by every particle in a step.
+     * 
+     * @param step  The step values to fill in.
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The change in time since the last acceleration.
+     */
+    void makeFloatStep(FloatStep* step, float ax, float ay, unsigned long dt){
+        step->dt = dt / 1000.0f; // convert dt to seconds
+        step->dvx = ax * step->dt;
+        step->dvy = ay * step->dt;
+        step->hx = 0.5f * step->dvx * step->dt;
+        step->hy = 0.5f * step->dvy * step->dt;
+    }
+    
     /* rounds dx and dy to -1, 0, or 1.
      * 
      * @param d    The change in x or y position. 
@@ -131,8 +568,30 @@
         return 0;
     }
     
-    
-    
+    /* Float version of integrateFixed().
+     * 
+     * @param x     The x position of the pixel.
+     * @param y     The y position of the pixel.
+     * @param grid  The pixel grid.
+     * @param cell  CELL(x, y).
+     * @param step  The values shared by every particle in this step.
+     * @returns     The cell the pixel ended up in.
+     */
+    uint8_t integrateFloat(uint8_t x, uint8_t y, PixelGrid* grid, uint8_t cell, const FloatStep* step){
+        float OrignalVelX = grid->vx[cell];
+        float OrignalVelY = grid->vy[cell];
+        
+        // use physics equation to calcuate the new postion: dx = vx*dt + (1/2)*ax*dt^2
+        float RawX = grid->rx[cell] + OrignalVelX * step->dt + step->hx;
+        float RawY = grid->ry[cell] + OrignalVelY * step->dt + step->hy;
+        
+        grid->rx[cell] = RawX;
+        grid->ry[cell] = RawY;
+        grid->vx[cell] = OrignalVelX + step->dvx;
+        grid->vy[cell] = OrignalVelY + step->dvy;
+        
+        return tryMove(x, y, signint(RawX), signint(RawY)); //try to move the pixel to the new postion dictated by its velocity and acceleration
+    }
     
     /* Apply acceleration to a pixel and possibly move it. The acceleration will
      * be converted into velocity(acceleration * change in time) that is added 
@@ -149,35 +608,512 @@
      * @param ax    The x component of the acceleration being applied to the pixel.
      * @param ay    The y component of the acceleration being applied to the pixel.
      * @param dt    The change in time since the last acceleration (in 100 us ticks).
+     * @returns     The cell the pixel ended up in.
      */
-    void applyAcceleration(uint8_t x, uint8_t y, float ax, float ay, unsigned long dt){
+    uint8_t accelerate(uint8_t x, uint8_t y, float ax, float ay, unsigned long dt){
         if (isMoved(x, y)) {
-            return;
+            return CELL(x, y);
+        }
+        FloatStep step;
+        makeFloatStep(&step, ax, ay, dt);
+        return integrateFloat(x, y, getPixelGrid(), CELL(x, y), &step);
+    }
+    
+    /* Float version of the fixed point isSlow().
+     * 
+     * @param grid  The pixel grid.
+     * @param cell  The cell of the pixel.
+     * @param pushX The way the acceleration pushes in x. (Should be -1, 0, or 1)
+     * @param pushY The way the acceleration pushes in y. (Should be -1, 0, or 1)
+     */
+    uint8_t isSlow(const PixelGrid* grid, uint8_t cell, int8_t pushX, int8_t pushY){
+        float vx = grid->vx[cell];
+        float vy = grid->vy[cell];
+        if ((pushX > 0 && vx > 0) || (pushX < 0 && vx < 0)) {
+            vx = 0;
+        }
+        if ((pushY > 0 && vy > 0) || (pushY < 0 && vy < 0)) {
+            vy = 0;
+        }
+        return fabsf(vx) < SLEEP_SPEED && fabsf(vy) < SLEEP_SPEED;
+    }
+    
+#endif
+    
+    /* Apply acceleration to a pixel and update the particle list, see accelerate().
+     */
+    void applyAcceleration(uint8_t x, uint8_t y, float ax, float ay, unsigned long dt){
+#if FIXED_POINT_PHYSICS
+        FixedStep step;
+        makeFixedStep(&step, ax, ay, dt);
+        uint8_t to = accelerateFixed(x, y, &step);
+#else
+        uint8_t to = accelerate(x, y, ax, ay, dt);
+#endif
+        if (to != CELL(x, y)) {
+            replaceParticle(CELL(x, y), to);
+        }
+    }
+    
+    /* Get the order a particle should be simulated in. Particles furthest along
+     * the acceleration go first so they get out of the way of the ones behind them.
+     * The axis with the most acceleration decides the order first.
+     * 
+     * @param cell  The cell the particle is in.
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @returns     The sweep key, lower keys are simulated first.
+     */
+    uint8_t sweepKey(uint8_t cell, float ax, float ay){
+        uint8_t x = cell % COLS;
+        uint8_t y = cell / COLS;
+        uint8_t xKey = ax > 0 ? COLS - 1 - x : x;
+        uint8_t yKey = ay > 0 ? ROWS - 1 - y : y;
+        if (fabsf(ay) >= fabsf(ax)) {
+            return yKey * COLS + xKey;
+        }
+        return xKey * ROWS + yKey;
+    }
+    
+    /* Sort the particle list into sweep order. The order barely changes between
+     * steps, so an insertion sort is close to a single pass.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     */
+    void sortParticles(float ax, float ay){
+        for (uint8_t i = 1; i < numParticles; i++) {
+            uint8_t cell = particles[i];
+            uint8_t key = sweepKey(cell, ax, ay);
+            uint8_t j = i;
+            while (j > 0 && sweepKey(particles[j - 1], ax, ay) > key) {
+                particles[j] = particles[j - 1];
+                j--;
+            }
+            particles[j] = cell;
+        }
+    }
+    
+    /* Wake every particle if the acceleration has changed enough since they
+     * fell asleep, or if it pushes in a new direction.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     */
+    void wakeOnAcceleration(float ax, float ay){
+        int8_t pushX = (ax > SLEEP_ACCEL) - (ax < -SLEEP_ACCEL);
+        int8_t pushY = (ay > SLEEP_ACCEL) - (ay < -SLEEP_ACCEL);
+        if (pushX != restPushX || pushY != restPushY || fabsf(ax - restAx) + fabsf(ay - restAy) > WAKE_ACCEL) {
+            wakeAll();
+            restAx = ax;
+            restAy = ay;
+            restPushX = pushX;
+            restPushY = pushY;
+        }
+    }
+    
+    /* Stop a particle and put it to sleep.
+     * 
+     * @param x     The x position of the particle.
+     * @param y     The y position of the particle.
+     * @param grid  The pixel grid.
+     */
+    void rest(uint8_t x, uint8_t y, PixelGrid* grid){
+        uint8_t cell = CELL(x, y);
+        // start from rest when it wakes up
+        grid->vx[cell] = 0;
+        grid->vy[cell] = 0;
+        grid->rx[cell] = 0;
+        grid->ry[cell] = 0;
+        asleep[y] |= 1u << x;
+    }
+    
+    /* Put a particle that didn't move to sleep if it is slow and every move
+     * the acceleration could push it into is blocked. From rest it would get
+     * stopped in the same place again, until a neighbour moves or the
+     * acceleration changes.
+     * 
+     * @param x     The x position of the particle.
+     * @param y     The y position of the particle.
+     * @param grid  The pixel grid.
+     * @returns     1 if the particle fell asleep.
+     */
+    uint8_t trySleep(uint8_t x, uint8_t y, PixelGrid* grid){
+        uint8_t moves[MOVE_COUNT];
+        if (openMoves(x, y, restPushX, restPushY, 0, 0, moves) != 0 || !isSlow(grid, CELL(x, y), restPushX, restPushY)) {
+            return 0;
+        }
+        rest(x, y, grid);
+        return 1;
+    }
+    
+    /* Count the full cells at one end of a line of the grid.
+     * 
+     * @param line      Bitmap of the line, bit 0 is the first cell.
+     * @param length    The number of cells in the line.
+     * @param end       1 to count from the last cell, -1 to count from the first.
+     * @returns         The number of full cells in a row at that end.
+     */
+    uint8_t fillHeight(uint16_t line, uint8_t length, int8_t end){
+        uint8_t first;
+        if (end > 0) {
+            // line up the last cell with the top bit and find the first gap from the left
+            first = __builtin_ff1l((uint16_t) ~(line << (16 - length)));
+        } else {
+            first = __builtin_ff1r((uint16_t) ~line);
+        }
+        return first ? first - 1 : length;
+    }
+    
+    /* Split the grid into lines along the acceleration when it pushes along
+     * only one axis and that axis dominates: the columns when it pushes along
+     * y and the rows when it pushes along x. The fill height of each line
+     * against the wall it is pushed toward is read from the bitmaps with one
+     * find-first-one per line, then the minimum is taken with the lines on
+     * either side. A particle that is less than support[line] cells from the
+     * wall has full cells in front of it and on both sides (or the edge of the
+     * grid), so it can't move.
+     * 
+     * @param ax        The x component of the acceleration.
+     * @param ay        The y component of the acceleration.
+     * @param support   Filled in with the support of each line.
+     * @returns         LINES_COLUMNS, LINES_ROWS, or LINES_NONE if neither
+     *                  axis dominates.
+     */
+    uint8_t findLines(float ax, float ay, uint8_t* support){
+        uint8_t heights[MAX_LINES];
+        uint8_t lines;
+        uint8_t axis;
+        if (restPushX == 0 && restPushY != 0 && fabsf(ay) > AXIS_DOMINANCE * fabsf(ax)) {
+            for (uint8_t col = 0; col < COLS; col++) {
+                heights[col] = fillHeight(columns[col], ROWS, restPushY);
+            }
+            lines = COLS;
+            axis = LINES_COLUMNS;
+        } else if (restPushY == 0 && restPushX != 0 && fabsf(ax) > AXIS_DOMINANCE * fabsf(ay)) {
+            for (uint8_t row = 0; row < ROWS; row++) {
+                heights[row] = fillHeight(occupancy[row], COLS, restPushX);
+            }
+            lines = ROWS;
+            axis = LINES_ROWS;
+        } else {
+            return LINES_NONE;
         }
-        float OrignalVelX = getVelocityX(x, y);
-        float OrignalVelY = getVelocityY(x, y);
-        float OrignalX = getRawRelativePositionX(x, y);
-        float OrignalY = getRawRelativePositionY(x, y);
-        // get original values
-        float timeChange = dt / 1000.0f; // convert dt to seconds
-           
         
-        float CurrentVelX = OrignalVelX + ax * timeChange;
-        float CurrentVelY = OrignalVelY + ay * timeChange;
-        // calculate the new velocity with the original velocity plus the acceleration
+        // the edges of the grid count as full lines
+        for (uint8_t i = 0; i < lines; i++) {
+            uint8_t height = heights[i];
+            if (i > 0 && heights[i - 1] < height) {
+                height = heights[i - 1];
+            }
+            if (i < lines - 1 && heights[i + 1] < height) {
+                height = heights[i + 1];
+            }
+            support[i] = height;
+        }
+        return axis;
+    }
+    
+    /* Find the line a particle is in and how far it is from the wall the
+     * acceleration pushes toward, see findLines().
+     * 
+     * @param x     The x position of the particle.
+     * @param y     The y position of the particle.
+     * @param axis  The return value of findLines().
+     * @param line  Filled in with the line of the particle.
+     * @returns     The number of cells between the particle and the wall.
+     */
+    uint8_t linePosition(uint8_t x, uint8_t y, uint8_t axis, uint8_t* line){
+        if (axis == LINES_COLUMNS) {
+            *line = x;
+            return restPushY > 0 ? ROWS - 1 - y : y;
+        }
+        *line = y;
+        return restPushX > 0 ? COLS - 1 - x : x;
+    }
+    
+    /* Step a particle along with the one in front of it in its line, which
+     * was stepped just before it and is still falling. They are in the same
+     * run, so they share a velocity and raw position, and the particle only
+     * has to go where the one in front went instead of being integrated and
+     * checking its neighbours. A whole run slides one cell this way.
+     * 
+     * @param x         The x position of the particle.
+     * @param y         The y position of the particle.
+     * @param grid      The pixel grid.
+     * @param leader    The cell the particle in front of it is in now.
+     * @returns         The cell the particle ended up in, or NO_MOVE if the
+     *                  cell in front of it was taken by another particle.
+     */
+    uint8_t follow(uint8_t x, uint8_t y, PixelGrid* grid, uint8_t leader){
+        uint8_t to = CELL(x, y);
+        if (leader != CELL(x + restPushX, y + restPushY)) {
+            // the run slid, follow it into the cell it left
+            if (!isOpen(x, y, restPushX, restPushY)) {
+                return NO_MOVE;
+            }
+            moveCell(x, y, x + restPushX, y + restPushY);
+            to = CELL(x + restPushX, y + restPushY);
+        }
+        grid->vx[to] = grid->vx[leader];
+        grid->vy[to] = grid->vy[leader];
+        grid->rx[to] = grid->rx[leader];
+        grid->ry[to] = grid->ry[leader];
+        return to;
+    }
+    
+    /* Step every particle once. The values that are the same for every
+     * particle are worked out once up front, then each particle is updated
+     * through a pointer into the grid storage. Sleeping particles are skipped.
+     * When the acceleration is close to straight along an axis, particles
+     * packed against the wall are put to sleep from the fill heights and runs
+     * of falling particles slide behind the particle at their front, so only
+     * the front of each run and the particles that can flow diagonally get a
+     * full step.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The length of the step.
+     * @returns     The number of particles that are still awake.
+     */
+    uint8_t physics_step(float ax, float ay, unsigned long dt){
+        // the same grid the moves go through
+        PixelGrid* grid = getPixelGrid();
+        wakeOnAcceleration(ax, ay);
+        if (gridAsleep) {
+            return 0;
+        }
         
-        float dx = OrignalVelX * timeChange + 0.5 * ax * timeChange * timeChange;
-        float dy = OrignalVelY * timeChange + 0.5 * ay * timeChange * timeChange;
-        // use physics equation to calcuate the change in x and y postion: dx = vx*dt + (1/2)*ax*dt^2
+        sortParticles(ax, ay);
+#if FIXED_POINT_PHYSICS
+        FixedStep step;
+        makeFixedStep(&step, ax, ay, dt);
+#else
+        FloatStep step;
+        makeFloatStep(&step, ax, ay, dt);
+#endif
+        uint8_t support[MAX_LINES];
+        uint8_t axis = findLines(ax, ay, support);
+        // the particle last stepped in each line, if it is still falling:
+        // how far it was from the wall before the step and the cell it is in now
+        uint8_t leadFrom[MAX_LINES];
+        uint8_t leadCell[MAX_LINES];
+        for (uint8_t line = 0; line < MAX_LINES; line++) {
+            leadFrom[line] = NO_MOVE;
+        }
         
-        float RawX = OrignalX + dx;
-        float RawY = OrignalY + dy;
-        //update the RawRelativePosition with the change in postion
+        // a particle that moves stays awake, so if none are awake nothing moved
+        uint8_t awake = 0;
+        for (uint8_t i = 0; i < numParticles; i++) {
+            uint8_t cell = particles[i];
+            uint8_t x = cell % COLS;
+            uint8_t y = cell / COLS;
+            if (asleep[y] >> x & 0b1) {
+                continue;
+            }
+            
+            uint8_t to = NO_MOVE;
+            uint8_t line = 0;
+            uint8_t distance = 0;
+            if (axis != LINES_NONE) {
+                distance = linePosition(x, y, axis, &line);
+                if (distance < support[line]) {
+                    // packed in against the wall, it can't move
+                    rest(x, y, grid);
+                    leadFrom[line] = NO_MOVE;
+                    continue;
+                }
+                // particles are stepped front first, so the one in front was just stepped
+                if (leadFrom[line] + 1 == distance) {
+                    to = follow(x, y, grid, leadCell[line]);
+                }
+            }
+            if (to != NO_MOVE) {
+                particles[i] = to;
+                awake++;
+            } else {
+#if FIXED_POINT_PHYSICS
+                to = integrateFixed(x, y, grid, cell, &step);
+#else
+                to = integrateFloat(x, y, grid, cell, &step);
+#endif
+                particles[i] = to;
+                if (to != cell || !trySleep(x, y, grid)) {
+                    awake++;
+                }
+            }
+            
+            if (axis != LINES_NONE) {
+                // the particles behind can follow this one if it went straight
+                // ahead or has room to
+                if (to == CELL(x + restPushX, y + restPushY) || (to == cell && isOpen(x, y, restPushX, restPushY))) {
+                    leadFrom[line] = distance;
+                    leadCell[line] = to;
+                } else {
+                    leadFrom[line] = NO_MOVE;
+                }
+            }
+        }
+        gridAsleep = awake == 0;
+        return awake;
+    }
+    
+    /* Apply acceleration to every particle, see physics_step().
+     */
+    void stepParticles(float ax, float ay, unsigned long dt){
+        physics_step(ax, ay, dt);
+    }
+    
+    /* Get the next number from a 16 bit xorshift generator. Much cheaper than
+     * rand() and good enough for breaking ties.
+     * 
+     * @returns     A pseudo random number, never 0.
+     */
+    uint16_t nextRandom(){
+        randomState ^= randomState << 7;
+        randomState ^= randomState >> 9;
+        randomState ^= randomState << 8;
+        return randomState;
+    }
+    
+    /* Check if a particle can move to a neighbour in the automaton. Moving
+     * sideways to the acceleration (two steps around the ring) is only
+     * allowed if there is somewhere to fall one cell further over, so water
+     * levels out instead of wandering around on a flat surface forever.
+     * 
+     * @param x     The x position of the particle.
+     * @param y     The y position of the particle.
+     * @param open  The inverse of neighbours(x, y).
+     * @param to    The neighbour to move to, as a position in the ring.
+     * @param down  The direction of the acceleration, as a position in the ring.
+     * @param k     How far around the ring from down the neighbour is.
+     */
+    uint8_t canSpread(uint8_t x, uint8_t y, uint16_t open, uint8_t to, uint8_t down, uint8_t k){
+        if (!(open >> NEIGHBOUR(ringX[to], ringY[to]) & 0b1)) {
+            return 0;
+        }
+        return k < 2 || isOpen(x, y, 2 * ringX[to] + ringX[down], 2 * ringY[to] + ringY[down]);
+    }
+    
+    /* Step every particle once with the cellular automaton rules. Each awake
+     * particle moves at most one cell: toward the acceleration if it can, and
+     * otherwise to the neighbours next to that around the ring, as far as its
+     * material allows. When both sides are open one is picked at random.
+     * Particles are visited front first and the order along the other axis
+     * flips every step, so piles don't lean one way. Only integer math is used.
+     * 
+     * Particles move one cell per step no matter how long it is, so the step
+     * doesn't take a time.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @returns     The number of particles that are still awake.
+     */
+    uint8_t automaton_step(float ax, float ay){
+        // the same grid the moves go through
+        PixelGrid* grid = getPixelGrid();
+        wakeOnAcceleration(ax, ay);
+        if (gridAsleep || (restPushX == 0 && restPushY == 0)) {
+            // nothing is pulling the particles anywhere
+            return 0;
+        }
         
-        setRawRelativePosition(x, y, RawX, RawY);
-        setVelocity(x, y, CurrentVelX, CurrentVelY);
-        //set the pixels data to its new values
+        // sort along the push, alternating the direction along an axis that isn't pushed
+        scanFlip ^= 1;
+        int8_t flip = scanFlip ? 1 : -1;
+        sortParticles(restPushX != 0 ? restPushX * 2 : flip, restPushY != 0 ? restPushY * 2 : flip);
         
-        tryMovePixel(x, y, signint(RawX), signint(RawY)); //try to move the pixel to the new postion dictated by its velocity and acceleration
+        uint8_t down = ringIndex[NEIGHBOUR(restPushX, restPushY)];
+        uint8_t spread = materialSpread[material];
+        uint8_t awake = 0;
+        for (uint8_t i = 0; i < numParticles; i++) {
+            uint8_t cell = particles[i];
+            uint8_t x = cell % COLS;
+            uint8_t y = cell / COLS;
+            if (asleep[y] >> x & 0b1) {
+                continue;
+            }
+            
+            uint16_t open = ~neighbours(x, y);
+            uint8_t to = NO_MOVE;
+            if (canSpread(x, y, open, down, down, 0)) {
+                to = down;
+            }
+            for (uint8_t k = 1; k <= spread && to == NO_MOVE; k++) {
+                // the two neighbours k steps around the ring from down, in random order
+                uint8_t first = (down + k) & 0b111;
+                uint8_t second = (down - k) & 0b111;
+                if (nextRandom() & 0b1) {
+                    uint8_t swap = first;
+                    first = second;
+                    second = swap;
+                }
+                if (canSpread(x, y, open, first, down, k)) {
+                    to = first;
+                } else if (canSpread(x, y, open, second, down, k)) {
+                    to = second;
+                }
+            }
+            
+            if (to == NO_MOVE) {
+                rest(x, y, grid);
+                continue;
+            }
+            moveCell(x, y, x + ringX[to], y + ringY[to]);
+            particles[i] = CELL(x + ringX[to], y + ringY[to]);
+            awake++;
+        }
+        gridAsleep = awake == 0;
+        return awake;
+    }
+    
+    /* Pick which engine advancePhysics() uses.
+     * 
+     * @param newEngine     PHYSICS_NEWTONIAN or PHYSICS_AUTOMATON.
+     */
+    void setPhysicsEngine(uint8_t newEngine){
+        engine = newEngine;
+        wakeAll();
+    }
+    
+    /* Change how long each step of advancePhysics() is.
+     * 
+     * @param length    The length of a step (in 100 us ticks).
+     */
+    void setPhysicsStep(unsigned int length){
+        stepLength = length;
+    }
+    
+    /* Run as many fixed length steps as fit in the time that has passed.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The change in time since the last call.
+     * @returns     The number of steps that had a particle awake.
+     */
+    uint8_t advancePhysics(float ax, float ay, unsigned long dt){
+        physicsTime += dt;
+        uint8_t steps = 0;
+        while (physicsTime >= stepLength) {
+            if (steps == MAX_PHYSICS_STEPS) {
+                // too far behind, drop the time instead of falling further behind
+                physicsTime %= stepLength;
+                break;
+            }
+            uint8_t awake;
+            if (engine == PHYSICS_AUTOMATON) {
+                awake = automaton_step(ax, ay);
+            } else {
+                awake = physics_step(ax, ay, stepLength);
+            }
+            if (awake == 0) {
+                // everything is asleep, nothing changes until something wakes up
+                physicsTime %= stepLength;
+                break;
+            }
+            clearMoved();
+            physicsTime -= stepLength;
+            steps++;
+        }
+        return steps;
     }
-
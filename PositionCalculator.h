@@ -12,6 +12,27 @@
 extern "C" {
 #endif
     
+    #define MATERIAL_SAND 0  // blocked pixels only try the straight moves
+    #define MATERIAL_WATER 1 // blocked pixels also slide the way they are moving
+    #define MATERIAL_RIGID 2 // blocked pixels stay put
+    
+    #define PHYSICS_NEWTONIAN 0 // particles have velocity and sub-cell position
+    #define PHYSICS_AUTOMATON 1 // particles move one cell per step by simple rules
+    #define PHYSICS_STEP 100 // length of a physics step to begin with (in 100 us ticks, 10 ms)
+    
+    /* Build the occupancy bitmap and the list of particles from the brightness
+     * of each pixel. Call this once after init_pixels(), movePixel() keeps them
+     * up to date after that.
+     */
+    void init_particles();
+    
+    /* Set how blocked pixels move. This just picks which moves tryMovePixel()
+     * is allowed to use, so it costs nothing per pixel.
+     * 
+     * @param material  MATERIAL_SAND, MATERIAL_WATER or MATERIAL_RIGID.
+     */
+    void setMaterial(uint8_t material);
+    
     /* Check if a position is open relative to another. AKA checking if the
      * pixel at (x + dx, y + dy) is lit already.
      * 
@@ -20,7 +41,7 @@ extern "C" {
      * @param dx    The change in x position. (Should be -1, 0, or 1)
      * @param dy    The change in y position. (Should be -1, 0, or 1)
      */
-    uint8_t isOpen(uint8_t x, uint8_t y, int dx, int dy);
+    uint8_t isOpen(uint8_t x, uint8_t y, int8_t dx, int8_t dy);
     
     /* Move a pixel to another position. The pixel at the (xTo, yTo) position
      * will be overwritten with the data from the pixel at the (xFrom, yFrom) 
@@ -42,7 +63,7 @@ extern "C" {
      * @param dx    The change in x position. (Should be -1, 0, or 1)
      * @param dy    The change in y position. (Should be -1, 0, or 1)   
      */
-    void tryMovePixel(uint8_t x, uint8_t y, int dx, int dy);
+    void tryMovePixel(uint8_t x, uint8_t y, int8_t dx, int8_t dy);
     
     /* Apply acceleration to a pixel and possibly move it. The acceleration will
      * be converted into velocity(acceleration * change in time) that is added 
@@ -61,6 +82,91 @@ extern "C" {
      * @param dt    The change in time since the last acceleration (in milliseconds).
      */
     void applyAcceleration(uint8_t x, uint8_t y, float ax, float ay, unsigned long dt);
+    
+    /* Step every particle in the grid once. Everything that is the same for
+     * all particles (the change in velocity and 1/2*a*dt^2) is worked out once
+     * per step, then each particle is updated directly in the grid storage
+     * instead of through the getters and setters. Particles are visited in
+     * the direction of the acceleration, so the ones in front move out of the
+     * way first.
+     * 
+     * When the acceleration pushes along one axis and dominates the other, the
+     * fill height of each line (column or row) against the wall is read from
+     * the occupancy bitmaps. Particles packed in below it go straight to sleep,
+     * and each run of particles falling in a line slides behind the particle
+     * at its front without its own neighbour checks. Diagonal flow still steps
+     * each particle on its own.
+     * 
+     * A slow particle that is blocked in every direction the acceleration
+     * pushes it falls asleep and is skipped until a neighbour moves or the acceleration
+     * changes direction or by more than WAKE_ACCEL. When every particle is
+     * asleep the step returns right away. It always steps the grid from
+     * getPixelGrid(), the one the moves are made in.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The length of the step (in 100 us ticks).
+     * @returns     The number of particles still awake. If this is 0 nothing
+     *              moved and nothing will until something wakes up.
+     */
+    uint8_t physics_step(float ax, float ay, unsigned long dt);
+    
+    /* Apply acceleration to every particle. This only visits cells that hold a
+     * particle, so it costs the same no matter how big the grid is. Particles
+     * are visited in the direction of the acceleration, so the ones in front
+     * move out of the way first. Same as physics_step().
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The change in time since the last acceleration.
+     */
+    void stepParticles(float ax, float ay, unsigned long dt);
+    
+    /* Step every particle once with cellular automaton rules instead of
+     * velocity. Each particle moves at most one cell per step: along the
+     * acceleration if it can, otherwise diagonally (and sideways for water),
+     * picking a side at random when both are open. Only uses integer math, so
+     * it is a lot cheaper than physics_step(). Sleeping works the same way.
+     * Like physics_step() it steps the grid from getPixelGrid(). It takes no
+     * time, because each step moves a particle one cell however long it is.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @returns     The number of particles still awake.
+     */
+    uint8_t automaton_step(float ax, float ay);
+    
+    /* Pick the engine advancePhysics() steps the particles with. Every
+     * particle is woken up so the new engine gets a look at all of them.
+     * 
+     * @param engine    PHYSICS_NEWTONIAN (physics_step()) or 
+     *                  PHYSICS_AUTOMATON (automaton_step()).
+     */
+    void setPhysicsEngine(uint8_t engine);
+    
+    /* Change the length of the steps advancePhysics() runs, PHYSICS_STEP (10 ms)
+     * to begin with. Longer steps cost less time for the same motion, but
+     * particles move further between collision checks.
+     * 
+     * @param length    The length of a step (in 100 us ticks).
+     */
+    void setPhysicsStep(unsigned int length);
+    
+    /* Advance the simulation by a number of fixed length steps. The time that
+     * is passed in is added to an accumulator and the step of the engine
+     * picked with setPhysicsEngine() is run once for every step in it,
+     * the rest carries over to the next call. This keeps motion the same no
+     * matter how often this is called or how long the sensor batches are. If
+     * the simulation falls more than MAX_PHYSICS_STEPS behind, the extra time
+     * is dropped. No steps are run while every particle is asleep.
+     * 
+     * @param ax    The x component of the acceleration.
+     * @param ay    The y component of the acceleration.
+     * @param dt    The change in time since the last call (in 100 us ticks).
+     * @returns     The number of steps that had a particle awake. The grid
+     *              only changed if this is not 0.
+     */
+    uint8_t advancePhysics(float ax, float ay, unsigned long dt);
 
 
 #ifdef	__cplusplus
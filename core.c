@@ -33,8 +33,29 @@
 #pragma config FNOSC = FRCPLL      // Oscillator Select (Fast RC Oscillator with PLL module (FRCPLL))
 
 #define ACCEL_MULTIPLIER 1.5
+#define RENDER_INTERVAL 200 // shortest time between display updates (in 100 us ticks, 20 ms)
+#define IDLE_TIME 20000     // time without motion before the display animates itself (in 100 us ticks, 2 s)
+#define MAX_RENDER_INTERVAL 1000 // longest time between display updates before quality runs out (in 100 us ticks, 100 ms)
+#define BUS_TARGET 50       // most of the time (in percent) the display uploads may keep the I2C bus busy
+#define CPU_TARGET 75       // most of the time (in percent) physics may keep the CPU busy
+#define TIMER_TICKS 25      // Timer3 ticks in 100 us (4 us each)
+#define LONG_PHYSICS_STEP 200 // physics step length at QUALITY_LONG_STEPS (in 100 us ticks, 20 ms)
+
+// Quality levels, the governor goes down them before it lets the frame rate drop
+#define QUALITY_FULL 0       // everything is simulated and sent
+#define QUALITY_NO_BLINK 1   // blink changes wait until the quality comes back
+#define QUALITY_LONG_STEPS 2 // physics also runs half as many, longer steps
 
 GravityVector vector;
+unsigned long renderTime = 0; // time since the display was last updated
+uint8_t renderPending = 0;    // the grid changed since the display was last updated
+unsigned long idleTime = 0;   // time since anything last moved
+unsigned int renderInterval = RENDER_INTERVAL; // time between display updates picked by the governor
+unsigned int uploadTime = 0;  // average time a frame takes to reach the display (in 100 us ticks)
+unsigned int physicsLoad = 0; // average time spent in physics (in percent)
+unsigned int renderStart = 0; // Timer3 when the last frame was queued
+uint8_t uploading = 0;        // the last frame hasn't reached the display yet
+uint8_t quality = QUALITY_FULL;
 void normalize(GravityVector* vector);
 
 // delay roughly an amount of time in milliseconds
@@ -46,6 +67,46 @@ void delay(int delay_in_ms) {
     }
 }
 
+// start Timer3 counting freely, the governor measures with it
+void init_timebase() {
+    T3CON = 0;
+    T3CONbits.TCKPS = 0b10; // 1:64 prescaler, 4 us per tick
+    TMR3 = 0;
+    PR3 = 0xFFFF;
+    T3CONbits.TON = 1;
+}
+
+// turn the parts of the frame that cost time on or off for a quality level
+void setQuality(uint8_t level) {
+    quality = level;
+    led_send_blinks(level < QUALITY_NO_BLINK);
+    setPhysicsStep(level >= QUALITY_LONG_STEPS ? LONG_PHYSICS_STEP : PHYSICS_STEP);
+}
+
+// pick the time between frames and the quality after a frame reached the display
+void governFrames() {
+    // frames can't come faster than this without the bus going over BUS_TARGET
+    unsigned long interval = (unsigned long) uploadTime * 100 / BUS_TARGET;
+    uint8_t overloaded = interval > MAX_RENDER_INTERVAL || physicsLoad > CPU_TARGET;
+    
+    if (overloaded && quality < QUALITY_LONG_STEPS) {
+        setQuality(quality + 1);
+    } else if (!overloaded && quality > QUALITY_FULL
+            && interval < MAX_RENDER_INTERVAL / 2 && physicsLoad < CPU_TARGET / 2) {
+        // well under budget, get some quality back
+        setQuality(quality - 1);
+    }
+    
+    if (interval > MAX_RENDER_INTERVAL && quality < QUALITY_LONG_STEPS) {
+        // there is still quality to give up before frames are dropped
+        interval = MAX_RENDER_INTERVAL;
+    }
+    if (interval < RENDER_INTERVAL) {
+        interval = RENDER_INTERVAL;
+    }
+    renderInterval = interval;
+}
+
 void setup() {
     CLKDIVbits.RCDIV = 0;
     
@@ -60,12 +121,15 @@ void setup() {
     
     TRISBbits.TRISB6 = 0;
     
+    init_timebase();
     init_i2c();
     bno085_init();
     delay(500);
     init_pixels(49);
+    init_particles();
     //lcd_init();
     led_init();
+    led_set_antialias(1); // particles move smoothly between cells
     write_all();
     delay(500);
     
@@ -76,6 +140,15 @@ int main(void) {
     setup();
     
     while (1) {
+        // the last frame reached the display, see how long it took. This is
+        // checked before physics runs so its time isn't counted as bus time
+        if (uploading && led_ready()) {
+            unsigned int spent = (TMR3 - renderStart) / TIMER_TICKS;
+            uploadTime = (3 * uploadTime + spent) / 4;
+            uploading = 0;
+            governFrames();
+        }
+        
         // get the acceleration vector
         getAccVector(&vector);
         
@@ -84,19 +157,39 @@ int main(void) {
             // apply acceleration
             float ax = vector.x * ACCEL_MULTIPLIER;
             float ay = vector.y * ACCEL_MULTIPLIER;
-            for (uint8_t row = 0; row < ROWS; row++) {
-                for (uint8_t col = 0; col < COLS; col++) {
-                    applyAcceleration(col, row, ay, ax, vector.deltaTime);
+            unsigned int physicsStart = TMR3;
+            uint8_t steps = advancePhysics(ay, ax, vector.deltaTime);
+            if (vector.deltaTime > 0) {
+                // share of the time since the last reading that physics took
+                unsigned long load = (unsigned long) ((TMR3 - physicsStart) / TIMER_TICKS) * 100 / vector.deltaTime;
+                physicsLoad = (3 * physicsLoad + (load > 100 ? 100 : load)) / 4;
+            }
+            if (steps > 0) {
+                renderPending = 1;
+                idleTime = 0;
+            } else if (idleTime < IDLE_TIME) {
+                idleTime += vector.deltaTime;
+                // everything settled, hand the display to the chip's autoplay
+                if (idleTime >= IDLE_TIME) {
+                    led_load_breathing();
+                    led_autoplay(ANIMATION_FRAMES, BREATH_DELAY);
                 }
             }
-            // display LEDS on device
+            renderTime += vector.deltaTime;
+        }
+        
+        // display LEDS on device, at most once every renderInterval
+        // the frame is sent in the background while the next one is calculated,
+        // so only start another once the last one is up
+        if (renderPending && renderTime >= renderInterval && !uploading) {
             write_all();
-            clearMoved();
+            // time the upload from when it is queued, drawing the frame isn't bus time
+            renderStart = TMR3;
+            uploading = 1;
+            renderPending = 0;
+            renderTime = 0;
         }
-        // delay for next update
-        delay(10);
         //displayGravityVector();
-        delay(10);
         
     }
     return 0;
@@ -11,8 +11,15 @@
 #define DOGS104_ADDR    0x3C     // 7-bit IC address
 #define LCD_CMD         0x00     // Control byte for commands
 #define LCD_DATA        0x40     // Control byte for data
+#define LCD_MAX_BYTES   12       // Commands or data per I2C write, 2 bytes each have to fit in MAX_DATA_SIZE
 
 void lcd_send_packet(const uint8_t* cmds, uint8_t length, uint8_t controlByte) {
+    // long packets are split into several writes, each one ends without the continuation bit
+    while (length > LCD_MAX_BYTES) {
+        lcd_send_packet(cmds, LCD_MAX_BYTES, controlByte);
+        cmds += LCD_MAX_BYTES;
+        length -= LCD_MAX_BYTES;
+    }
     uint8_t packet[length * 2];
     for (uint8_t i = 0; i < length; i++) {
         if (i < length - 1) {
@@ -15,13 +15,16 @@ extern "C" {
 #endif
     
     #define MAX_QUEUE_SIZE 20 // The maximum amount of transmissions that can be queued
-    #define MAX_DATA_SIZE 146 // The maximum amount of data per transmission
+    #define MAX_DATA_SIZE 24 // The maximum amount of data copied per transmission, bigger writes use a buffer or producer
     
     // structure of elements in the queue
     typedef struct {
         volatile uint8_t address_RW; // address + R/nW bit
         volatile uint8_t data[MAX_DATA_SIZE];      // the data to be sent, or a null ptr if reading
         volatile unsigned int data_size;      // the number of bytes to be written or read
+        volatile unsigned int copied;         // the first bytes written come from data, the rest from buffer
+        uint8_t* volatile buffer;             // caller's memory written after data, sent without a copy
+        volatile unsigned long producer;      // function making the bytes after data from buffer, 0 to send buffer as is
         volatile unsigned int read_bytes;
     } Transmission;
     
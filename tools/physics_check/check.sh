@@ -0,0 +1,37 @@
+#!/bin/sh
+# Replays tilt_sweep.csv through the fixed point and the float engine on a PC
+# and checks that both match expected.txt, the grids the engines produced when
+# they were last compared. Run from anywhere, needs gcc.
+#
+# After a change that is meant to move particles differently, check the new
+# grids by hand and save them with: check.sh --update
+
+cd "$(dirname "$0")" || exit 1
+ROOT=../..
+OUT=${TMPDIR:-/tmp}/physics_check.$$
+mkdir -p "$OUT" || exit 1
+trap 'rm -rf "$OUT"' EXIT
+
+for fixed in 1 0; do
+    gcc -std=gnu99 -O1 -w -Istub -I$ROOT -DFIXED_POINT_PHYSICS=$fixed replay.c \
+        $ROOT/PixelData.c $ROOT/PositionCalculator.c -lm -o "$OUT/replay$fixed" || exit 1
+    "$OUT/replay$fixed" < tilt_sweep.csv > "$OUT/grids$fixed.txt" || exit 1
+done
+
+if [ "$1" = "--update" ]; then
+    cp "$OUT/grids1.txt" expected.txt
+fi
+
+status=0
+if ! diff -q "$OUT/grids1.txt" "$OUT/grids0.txt" > /dev/null; then
+    echo "fixed point and float engines differ:"
+    diff "$OUT/grids1.txt" "$OUT/grids0.txt" | head -40
+    status=1
+fi
+if ! diff -q "$OUT/grids1.txt" expected.txt > /dev/null; then
+    echo "fixed point engine differs from expected.txt:"
+    diff "$OUT/grids1.txt" expected.txt | head -40
+    status=1
+fi
+[ $status -eq 0 ] && echo "both engines match expected.txt"
+exit $status
@@ -0,0 +1,47 @@
+/*
+ * File:   replay.c
+ *
+ * Replays an accelerometer trace through advancePhysics() on a PC and prints
+ * the grid every CHECKPOINT readings, '#' for a lit pixel and '.' for an
+ * empty one. Built once with each engine by check.sh, which compares them.
+ *
+ * Trace lines are "ax, ay, dt", the values core.c passes to advancePhysics().
+ * Lines starting with # are skipped.
+ */
+
+#include "xc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "stdint.h"
+#include "PixelData.h"
+#include "PositionCalculator.h"
+
+#define CHECKPOINT 25 // readings between printed grids
+
+int main(void) {
+    char line[80];
+    float ax, ay;
+    unsigned long dt;
+    int readings = 0;
+    
+    srand(1); // init_pixels() picks random brightness and blink
+    init_pixels(49);
+    init_particles();
+    
+    while (fgets(line, sizeof(line), stdin)) {
+        if (line[0] == '#' || sscanf(line, "%f, %f, %lu", &ax, &ay, &dt) != 3) {
+            continue;
+        }
+        advancePhysics(ax, ay, dt);
+        if (++readings % CHECKPOINT == 0) {
+            printf("reading %d\n", readings);
+            for (int y = 0; y < ROWS; y++) {
+                for (int x = 0; x < COLS; x++) {
+                    putchar(getBrightness(x, y) > 0 ? '#' : '.');
+                }
+                putchar('\n');
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,9 @@
+/*
+ * Stand-in for the XC16 device header so the physics can be built on a PC.
+ * PixelData.c and PositionCalculator.c don't touch any special function registers.
+ */
+#include <stdint.h>
+
+// XC16 find first one builtins on a 16 bit word, 1 based and 0 if there are none
+#define __builtin_ff1r(x) __builtin_ffs((uint16_t) (x))
+#define __builtin_ff1l(x) ((uint16_t) (x) ? __builtin_clz((uint16_t) (x)) - 15 : 0)